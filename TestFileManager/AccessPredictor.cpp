@@ -0,0 +1,223 @@
+//
+//  AccessPredictor.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#include "AccessPredictor.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+static const char tableMagic[] = "RMAP";
+static const uint64_t tableVersion = 1;
+
+const size_t AccessPredictor::maxSuccessorsCount;
+const size_t AccessPredictor::maxPredictionsCount;
+const uint64_t AccessPredictor::predictionLifetime;
+constexpr double AccessPredictor::minimumProbability;
+
+static void writeUInt64(FILE* file, uint64_t value) {
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+static void writeString(FILE* file, const std::string& string) {
+    writeUInt64(file, string.size());
+    fwrite(string.data(), 1, string.size(), file);
+}
+
+static bool readUInt64(FILE* file, uint64_t& value) {
+    return fread(&value, sizeof(value), 1, file) == 1;
+}
+
+static bool readString(FILE* file, std::string& string) {
+    uint64_t size = 0;
+    if (!readUInt64(file, size) || size > 64 * 1024) return false;
+    
+    string.resize(size);
+    return size == 0 || fread(&string[0], 1, size, file) == size;
+}
+
+AccessPredictor::AccessPredictor() :
+    accessIndex(0)
+{
+}
+
+std::vector<std::string> AccessPredictor::recordAccess(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    accessIndex++;
+    stats.accessesCount++;
+    
+    auto pendingIt = pendingPredictions.find(key);
+    if (pendingIt != pendingPredictions.end()) {
+        stats.usedPredictionsCount++;
+        stats.predictedAccessesCount++;
+        pendingPredictions.erase(pendingIt);
+    }
+    expirePredictions();
+    
+    // repeated reads of one file say nothing about the sequence
+    if (!lastKey.empty() && lastKey != key)
+        learn(lastKey, key);
+    lastKey = key;
+    
+    std::vector<std::string> predictions;
+    
+    auto it = table.find(key);
+    if (it == table.end()) return predictions;
+    
+    const Transitions& transitions = it->second;
+    for (auto& successor : transitions.successors) {
+        if (predictions.size() >= maxPredictionsCount) break;
+        if (successor.count < minimumProbability * transitions.totalCount) break;
+        if (successor.key == key || pendingPredictions.count(successor.key)) continue;
+        
+        pendingPredictions[successor.key] = accessIndex;
+        predictions.push_back(successor.key);
+    }
+    stats.predictionsCount += predictions.size();
+    
+    return predictions;
+}
+
+// Space saving: a successor not in the list takes the place of the least frequent
+// one and inherits its count, so a changed sequence wins over time.
+void AccessPredictor::learn(const std::string& key, const std::string& successorKey) {
+    Transitions& transitions = table[key];
+    transitions.totalCount++;
+    
+    std::vector<Successor>& successors = transitions.successors;
+    auto it = std::find_if(successors.begin(), successors.end(), [&successorKey](const Successor& successor) {
+        return successor.key == successorKey;
+    });
+    
+    if (it == successors.end()) {
+        if (successors.size() < maxSuccessorsCount) {
+            Successor successor;
+            successor.key = successorKey;
+            successor.count = 0;
+            successors.push_back(successor);
+        }
+        else {
+            successors.back().key = successorKey;
+        }
+        it = successors.end() - 1;
+    }
+    it->count++;
+    
+    // keep the list sorted by count
+    while (it != successors.begin() && (it - 1)->count < it->count) {
+        std::iter_swap(it - 1, it);
+        --it;
+    }
+}
+
+void AccessPredictor::expirePredictions() {
+    for (auto it = pendingPredictions.begin(); it != pendingPredictions.end();) {
+        if (accessIndex - it->second > predictionLifetime)
+            pendingPredictions.erase(it++);
+        else
+            ++it;
+    }
+}
+
+bool AccessPredictor::save(const std::string& tableFile) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    std::string tempFile = tableFile + ".tmp";
+    FILE* file = fopen(tempFile.c_str(), "wb");
+    if (!file) return false;
+    
+    fwrite(tableMagic, 1, 4, file);
+    writeUInt64(file, tableVersion);
+    writeUInt64(file, table.size());
+    
+    for (auto& keyTransitionsPair : table) {
+        writeString(file, keyTransitionsPair.first);
+        writeUInt64(file, keyTransitionsPair.second.totalCount);
+        writeUInt64(file, keyTransitionsPair.second.successors.size());
+        for (auto& successor : keyTransitionsPair.second.successors) {
+            writeString(file, successor.key);
+            writeUInt64(file, successor.count);
+        }
+    }
+    
+    bool succeeded = !ferror(file);
+    succeeded = (fclose(file) == 0) && succeeded;
+    
+    if (!succeeded || rename(tempFile.c_str(), tableFile.c_str()) != 0) {
+        unlink(tempFile.c_str());
+        return false;
+    }
+    
+    return true;
+}
+
+// Replaces the table, keeps it as it was if the file is missing or damaged.
+bool AccessPredictor::load(const std::string& tableFile) {
+    FILE* file = fopen(tableFile.c_str(), "rb");
+    if (!file) return false;
+    
+    std::map<std::string, Transitions> loadedTable;
+    
+    bool succeeded = false;
+    do {
+        char magic[4];
+        uint64_t version = 0, keysCount = 0;
+        if (fread(magic, 1, 4, file) != 4 || memcmp(magic, tableMagic, 4) != 0) break;
+        if (!readUInt64(file, version) || version != tableVersion) break;
+        if (!readUInt64(file, keysCount)) break;
+        
+        bool keyFailed = false;
+        for (uint64_t i = 0; i < keysCount && !keyFailed; i++) {
+            keyFailed = true;
+            
+            std::string key;
+            uint64_t totalCount, successorsCount;
+            if (!readString(file, key) || !readUInt64(file, totalCount) ||
+                !readUInt64(file, successorsCount) || successorsCount > maxSuccessorsCount) break;
+            
+            Transitions& transitions = loadedTable[key];
+            transitions.totalCount = (uint32_t)totalCount;
+            
+            bool successorFailed = false;
+            for (uint64_t j = 0; j < successorsCount && !successorFailed; j++) {
+                Successor successor;
+                uint64_t count;
+                successorFailed = !readString(file, successor.key) || !readUInt64(file, count);
+                successor.count = (uint32_t)count;
+                transitions.successors.push_back(successor);
+            }
+            keyFailed = successorFailed;
+        }
+        
+        succeeded = !keyFailed;
+    } while (false);
+    
+    fclose(file);
+    if (!succeeded) return false;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    table.swap(loadedTable);
+    return true;
+}
+
+AccessPredictorStats AccessPredictor::getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void AccessPredictor::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    table.clear();
+    lastKey.clear();
+    pendingPredictions.clear();
+    accessIndex = 0;
+    stats = AccessPredictorStats();
+}
@@ -0,0 +1,71 @@
+//
+//  AccessPredictor.h
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+
+struct AccessPredictorStats {
+    size_t accessesCount = 0;
+    size_t predictionsCount = 0;            // files predicted and prefetched
+    size_t usedPredictionsCount = 0;        // of those, read before they expired
+    size_t predictedAccessesCount = 0;      // reads that had been predicted
+    
+    double getAccuracy() const { return predictionsCount ? double(usedPredictionsCount) / predictionsCount : 0; }
+    double getCoverage() const { return accessesCount ? double(predictedAccessesCount) / accessesCount : 0; }
+};
+
+// First order Markov table of which file is read after which. Every key keeps its
+// most frequent successors with counts, a new successor replaces the least frequent
+// one. Successors seen at least minimumProbability of the times are predicted.
+// Predictions not read within the next predictionLifetime accesses are wasted.
+class AccessPredictor
+{
+public:
+    AccessPredictor();
+    
+    // learns the access and returns the files to prefetch, not predicted already
+    std::vector<std::string> recordAccess(const std::string& key);
+    
+    bool save(const std::string& tableFile);
+    bool load(const std::string& tableFile);
+    
+    AccessPredictorStats getStats();
+    void clear();
+    
+    static const size_t maxSuccessorsCount = 8;
+    static const size_t maxPredictionsCount = 4;
+    static const uint64_t predictionLifetime = 64;
+    static constexpr double minimumProbability = 0.25;
+    
+private:
+    struct Successor {
+        std::string key;
+        uint32_t count;
+    };
+    struct Transitions {
+        std::vector<Successor> successors;   // most frequent first
+        uint32_t totalCount = 0;
+    };
+    
+    std::map<std::string, Transitions> table;
+    std::string lastKey;
+    
+    std::map<std::string, uint64_t> pendingPredictions;   // key -> access it was predicted at
+    uint64_t accessIndex;
+    
+    AccessPredictorStats stats;
+    std::mutex mutex;
+    
+    void learn(const std::string& key, const std::string& successorKey);
+    void expirePredictions();
+};
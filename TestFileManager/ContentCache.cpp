@@ -0,0 +1,338 @@
+//
+//  ContentCache.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#include "ContentCache.h"
+
+#include <algorithm>
+
+//
+// LRU policy
+//
+
+void LRUContentCachePolicy::inserted(const std::string& key) {
+    keys.push_front(key);
+    keysMap[key] = keys.begin();
+}
+
+void LRUContentCachePolicy::accessed(const std::string& key) {
+    auto it = keysMap.find(key);
+    if (it != keysMap.end())
+        keys.splice(keys.begin(), keys, it->second);
+}
+
+void LRUContentCachePolicy::erased(const std::string& key) {
+    auto it = keysMap.find(key);
+    if (it == keysMap.end()) return;
+    
+    keys.erase(it->second);
+    keysMap.erase(it);
+}
+
+const std::string* LRUContentCachePolicy::selectVictim() {
+    return keys.empty() ? nullptr : &keys.back();
+}
+
+void LRUContentCachePolicy::clear() {
+    keys.clear();
+    keysMap.clear();
+}
+
+//
+// W-TinyLFU policy
+//
+
+FrequencySketch::FrequencySketch(size_t width) :
+    additionsCount(0)
+{
+    // power of two, so a mask selects the column
+    size_t columns = 16;
+    while (columns < width) columns <<= 1;
+    
+    counters.assign(depth * columns, 0);
+    mask = columns - 1;
+    resetThreshold = columns * 10;
+}
+
+size_t FrequencySketch::getIndex(size_t hash, size_t row) const {
+    // a different odd multiplier per row, then fold the high bits in
+    static const uint64_t seeds[depth] = { 0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL };
+    uint64_t h = (uint64_t(hash) + row) * seeds[row];
+    h ^= h >> 32;
+    return row * (mask + 1) + (h & mask);
+}
+
+void FrequencySketch::increment(const std::string& key) {
+    size_t hash = std::hash<std::string>()(key);
+    bool added = false;
+    
+    for (size_t row = 0; row < depth; row++) {
+        uint8_t& counter = counters[getIndex(hash, row)];
+        if (counter < maxCount) {
+            counter++;
+            added = true;
+        }
+    }
+    
+    // aging keeps the sketch biased towards recent history
+    if (added && ++additionsCount >= resetThreshold) {
+        for (auto& counter : counters) {
+            counter >>= 1;
+        }
+        additionsCount /= 2;
+    }
+}
+
+unsigned FrequencySketch::frequency(const std::string& key) const {
+    size_t hash = std::hash<std::string>()(key);
+    unsigned frequency = maxCount;
+    
+    for (size_t row = 0; row < depth; row++) {
+        frequency = std::min<unsigned>(frequency, counters[getIndex(hash, row)]);
+    }
+    return frequency;
+}
+
+void FrequencySketch::clear() {
+    std::fill(counters.begin(), counters.end(), 0);
+    additionsCount = 0;
+}
+
+TinyLFUContentCachePolicy::TinyLFUContentCachePolicy(size_t sketchWidth /* = 4096 */) :
+    sketch(sketchWidth)
+{
+}
+
+void TinyLFUContentCachePolicy::recordLookup(const std::string& key) {
+    sketch.increment(key);
+}
+
+// The window keeps one entry over its size, the candidate of the next eviction.
+// Entries pushed out by insertions alone go to the main space, so it fills up
+// before anything has to compete.
+void TinyLFUContentCachePolicy::inserted(const std::string& key) {
+    moveTo(WindowSegment, key);
+    
+    while (segments[WindowSegment].size() > getMaxWindowCount() + 1) {
+        moveTo(ProbationSegment, segments[WindowSegment].back());
+    }
+}
+
+size_t TinyLFUContentCachePolicy::getMaxWindowCount() const {
+    return std::max<size_t>(1, keysMap.size() / 100);
+}
+
+void TinyLFUContentCachePolicy::accessed(const std::string& key) {
+    auto it = keysMap.find(key);
+    if (it == keysMap.end()) return;
+    
+    if (it->second.first == WindowSegment) {
+        moveTo(WindowSegment, key);
+        return;
+    }
+    
+    moveTo(ProtectedSegment, key);
+    
+    // the protected segment holds at most 80% of the main space
+    size_t mainCount = segments[ProbationSegment].size() + segments[ProtectedSegment].size();
+    while (segments[ProtectedSegment].size() > std::max<size_t>(1, mainCount * 4 / 5)) {
+        moveTo(ProbationSegment, segments[ProtectedSegment].back());
+    }
+}
+
+void TinyLFUContentCachePolicy::erased(const std::string& key) {
+    auto it = keysMap.find(key);
+    if (it == keysMap.end()) return;
+    
+    segments[it->second.first].erase(it->second.second);
+    keysMap.erase(it);
+}
+
+// Once the window outgrows 1% of the entries, its least recent entry competes with
+// the main segment's victim: the one seen more often stays, the other is evicted.
+const std::string* TinyLFUContentCachePolicy::selectVictim() {
+    std::list<std::string>& window = segments[WindowSegment];
+    std::list<std::string>& probation = segments[ProbationSegment];
+    std::list<std::string>& protectedKeys = segments[ProtectedSegment];
+    
+    if (probation.empty() && !protectedKeys.empty())
+        moveTo(ProbationSegment, protectedKeys.back());
+    
+    if (window.empty()) return probation.empty() ? nullptr : &probation.back();
+    if (probation.empty()) return &window.back();
+    
+    if (window.size() <= getMaxWindowCount()) return &probation.back();
+    
+    if (sketch.frequency(window.back()) > sketch.frequency(probation.back())) {
+        moveTo(ProbationSegment, window.back());
+        return &probation.back();
+    }
+    
+    return &window.back();
+}
+
+void TinyLFUContentCachePolicy::clear() {
+    for (auto& segment : segments) {
+        segment.clear();
+    }
+    keysMap.clear();
+    sketch.clear();
+}
+
+void TinyLFUContentCachePolicy::moveTo(Segment segment, std::string key) {
+    auto it = keysMap.find(key);
+    if (it != keysMap.end())
+        segments[it->second.first].erase(it->second.second);
+    
+    segments[segment].push_front(key);
+    keysMap[key] = std::make_pair(segment, segments[segment].begin());
+}
+
+//
+// cache
+//
+
+ContentCache::ContentCache(size_t capacity, std::unique_ptr<ContentCachePolicy> policy /* = nullptr */) :
+    policy(policy ? std::move(policy) : std::unique_ptr<ContentCachePolicy>(new LRUContentCachePolicy())),
+    capacity(capacity)
+{
+}
+
+bool ContentCache::lookup(const std::string& key, std::shared_ptr<const char>& data, size_t& size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    policy->recordLookup(key);
+    
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        stats.misses++;
+        return false;
+    }
+    
+    policy->accessed(key);
+    stats.hits++;
+    
+    data = it->second.data;
+    size = it->second.size;
+    return true;
+}
+
+bool ContentCache::insert(const std::string& key, const std::shared_ptr<const char>& data, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    auto it = entries.find(key);
+    if (it != entries.end())
+        erase(it);
+    
+    if (size > capacity || !evictFor(key, size)) {
+        stats.rejections++;
+        return false;
+    }
+    
+    Entry& entry = entries[key];
+    entry.data = data;
+    entry.size = size;
+    policy->inserted(key);
+    
+    stats.insertions++;
+    stats.usedBytes += size;
+    stats.entriesCount++;
+    return true;
+}
+
+// The policy's admission decision is taken against the first victim only,
+// further victims are evicted until the new entry fits.
+bool ContentCache::evictFor(const std::string& key, size_t size) {
+    if (stats.usedBytes + size <= capacity) return true;
+    
+    const std::string* victimKey = policy->selectVictim();
+    if (!victimKey || !policy->shouldAdmit(key, *victimKey)) return false;
+    
+    for (;;) {
+        erase(entries.find(*victimKey));
+        stats.evictions++;
+        if (stats.usedBytes + size <= capacity) return true;
+        
+        victimKey = policy->selectVictim();
+        if (!victimKey) return false;
+    }
+}
+
+void ContentCache::erase(std::map<std::string, Entry>::iterator it) {
+    policy->erased(it->first);
+    stats.usedBytes -= it->second.size;
+    stats.entriesCount--;
+    entries.erase(it);
+}
+
+void ContentCache::invalidate(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    auto it = entries.find(key);
+    if (it != entries.end())
+        erase(it);
+}
+
+void ContentCache::invalidatePrefix(const std::string& prefix) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    auto it = entries.lower_bound(prefix);
+    while (it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        erase(it++);
+    }
+}
+
+void ContentCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    entries.clear();
+    policy->clear();
+    stats.usedBytes = 0;
+    stats.entriesCount = 0;
+}
+
+void ContentCache::setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    this->capacity = capacity;
+    while (stats.usedBytes > capacity) {
+        const std::string* victimKey = policy->selectVictim();
+        if (!victimKey) break;
+        
+        erase(entries.find(*victimKey));
+        stats.evictions++;
+    }
+}
+
+size_t ContentCache::getCapacity() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return capacity;
+}
+
+void ContentCache::setPolicy(std::unique_ptr<ContentCachePolicy> policy) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    entries.clear();
+    stats.usedBytes = 0;
+    stats.entriesCount = 0;
+    this->policy = policy ? std::move(policy) : std::unique_ptr<ContentCachePolicy>(new LRUContentCachePolicy());
+}
+
+ContentCacheStats ContentCache::getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void ContentCache::resetStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    size_t usedBytes = stats.usedBytes;
+    size_t entriesCount = stats.entriesCount;
+    stats = ContentCacheStats();
+    stats.usedBytes = usedBytes;
+    stats.entriesCount = entriesCount;
+}
@@ -0,0 +1,153 @@
+//
+//  ContentCache.h
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <string>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+// Decides which entry leaves the cache. Calls are serialized by the cache.
+class ContentCachePolicy
+{
+public:
+    virtual ~ContentCachePolicy() {}
+    
+    virtual void inserted(const std::string& key) = 0;
+    virtual void accessed(const std::string& key) = 0;     // hit
+    virtual void erased(const std::string& key) = 0;
+    
+    // entry to evict next, nullptr if the policy tracks nothing
+    virtual const std::string* selectVictim() = 0;
+    
+    // every lookup, hit or miss, before any other call for the key
+    virtual void recordLookup(const std::string& /*key*/) {}
+    // a new entry would evict the victim, false keeps the victim and drops the candidate
+    virtual bool shouldAdmit(const std::string& /*candidateKey*/, const std::string& /*victimKey*/) { return true; }
+    
+    virtual void clear() = 0;
+};
+
+class LRUContentCachePolicy : public ContentCachePolicy
+{
+public:
+    virtual void inserted(const std::string& key);
+    virtual void accessed(const std::string& key);
+    virtual void erased(const std::string& key);
+    virtual const std::string* selectVictim();
+    virtual void clear();
+    
+private:
+    std::list<std::string> keys;    // most recently used first
+    std::unordered_map<std::string, std::list<std::string>::iterator> keysMap;
+};
+
+// Count-min sketch of 4 bit saturating counters, halved periodically.
+class FrequencySketch
+{
+public:
+    explicit FrequencySketch(size_t width);
+    
+    void increment(const std::string& key);
+    unsigned frequency(const std::string& key) const;
+    void clear();
+    
+private:
+    static const size_t depth = 4;
+    static const uint8_t maxCount = 15;
+    
+    std::vector<uint8_t> counters;      // depth rows of mask + 1 columns
+    size_t mask;
+    size_t additionsCount;
+    size_t resetThreshold;
+    
+    size_t getIndex(size_t hash, size_t row) const;
+};
+
+// W-TinyLFU: new entries enter a small LRU window, candidates leaving it are
+// admitted to the segmented LRU main space only if they are used more often than
+// its victim. Entries read once, as in a scan over everything, pass through the
+// window without evicting the working set.
+class TinyLFUContentCachePolicy : public ContentCachePolicy
+{
+public:
+    // sketchWidth ~ the number of entries expected in the cache
+    explicit TinyLFUContentCachePolicy(size_t sketchWidth = 4096);
+    
+    virtual void recordLookup(const std::string& key);
+    virtual void inserted(const std::string& key);
+    virtual void accessed(const std::string& key);
+    virtual void erased(const std::string& key);
+    virtual const std::string* selectVictim();
+    virtual void clear();
+    
+private:
+    enum Segment { WindowSegment, ProbationSegment, ProtectedSegment, SegmentsCount };
+    
+    FrequencySketch sketch;
+    std::list<std::string> segments[SegmentsCount];     // most recently used first
+    std::unordered_map<std::string, std::pair<Segment, std::list<std::string>::iterator>> keysMap;
+    
+    size_t getMaxWindowCount() const;
+    void moveTo(Segment segment, std::string key);
+};
+
+struct ContentCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t insertions = 0;
+    size_t rejections = 0;      // not admitted by size or by the policy
+    size_t evictions = 0;
+    size_t usedBytes = 0;
+    size_t entriesCount = 0;
+};
+
+// Thread safe byte budgeted cache of immutable buffers.
+class ContentCache
+{
+public:
+    explicit ContentCache(size_t capacity, std::unique_ptr<ContentCachePolicy> policy = nullptr);
+    
+    bool lookup(const std::string& key, std::shared_ptr<const char>& data, size_t& size);
+    bool insert(const std::string& key, const std::shared_ptr<const char>& data, size_t size);
+    
+    void invalidate(const std::string& key);
+    void invalidatePrefix(const std::string& prefix);
+    void clear();
+    
+    void setCapacity(size_t capacity);
+    size_t getCapacity();
+    // LRU when nullptr, drops all entries
+    void setPolicy(std::unique_ptr<ContentCachePolicy> policy);
+    
+    ContentCacheStats getStats();
+    void resetStats();
+    
+private:
+    struct Entry {
+        std::shared_ptr<const char> data;
+        size_t size;
+    };
+    
+    std::map<std::string, Entry> entries;   // ordered for prefix invalidation
+    std::unique_ptr<ContentCachePolicy> policy;
+    size_t capacity;
+    ContentCacheStats stats;
+    std::mutex mutex;
+    
+    void erase(std::map<std::string, Entry>::iterator it);
+    bool evictFor(const std::string& key, size_t size);
+    
+    ContentCache(const ContentCache&);
+    ContentCache &operator=(const ContentCache&);
+};
@@ -0,0 +1,289 @@
+//
+//  DiskCache.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#include "DiskCache.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#include <vector>
+#include <algorithm>
+
+static const char* tempFileSuffix = ".tmp";
+
+// temporary files this old were left by a process that died while writing them
+static const time_t tempFileMaximumAge = 60 * 60;
+
+static bool hasTempFileSuffix(const std::string& filename) {
+    size_t suffixLength = strlen(tempFileSuffix);
+    return filename.size() >= suffixLength && filename.compare(filename.size() - suffixLength, suffixLength, tempFileSuffix) == 0;
+}
+
+static size_t skipDigits(const std::string& filename, size_t position, bool hex) {
+    while (position < filename.size() && (hex ? isxdigit(filename[position]) : isdigit(filename[position]))) position++;
+    return position;
+}
+
+// length of the "%016llx-%08x-%llu" key filename starts with, 0 if it doesn't
+static size_t matchKey(const std::string& filename) {
+    if (skipDigits(filename, 0, true) != 16 || filename.size() < 27 || filename[16] != '-') return 0;
+    if (skipDigits(filename, 17, true) != 25 || filename[25] != '-') return 0;
+    
+    size_t end = skipDigits(filename, 26, false);
+    return end > 26 ? end : 0;
+}
+
+DiskCache::DiskCache() :
+    budget(0),
+    tempFilesCount(0),
+    generation(0),
+    evicting(false)
+{
+}
+
+void DiskCache::setFolder(const std::string& folder, size_t budget) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        
+        this->folder = folder;
+        this->budget = budget;
+        stats = ContentCacheStats();
+        verifiedKeys.clear();
+        generation++;
+        if (folder.empty()) return;
+    }
+    
+    mkdir(folder.c_str(), 0755);
+    
+    // files left by earlier runs count against the budget
+    evict();
+}
+
+bool DiskCache::isEnabled() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return !folder.empty();
+}
+
+// CRC-32 of the file past the bytes already read, continuing crc
+static uint32_t crcFileTail(int fd, size_t offset, size_t fileSize, uLong crc) {
+    char chunk[64 * 1024];
+    while (offset < fileSize) {
+        ssize_t ret = pread(fd, chunk, std::min(sizeof(chunk), fileSize - offset), offset);
+        if (ret <= 0) break;
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(chunk), (uInt)ret);
+        offset += ret;
+    }
+    return offset == fileSize ? (uint32_t)crc : ~(uint32_t)crc;
+}
+
+bool DiskCache::read(const std::string& key, size_t expectedSize, uint32_t expectedCrc, void* buffer, size_t size, size_t& bytesRead) {
+    std::string filePath;
+    bool verified;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (folder.empty()) return false;
+        filePath = folder + "/" + key;
+        verified = verifiedKeys.count(key) > 0;
+    }
+    
+    bytesRead = 0;
+    bool deleted = false;
+    int fd = open(filePath.c_str(), O_RDONLY);
+    
+    // a file of another size is a leftover of a different archive
+    struct stat stat_buf;
+    bool found = fd >= 0 && fstat(fd, &stat_buf) == 0 && (size_t)stat_buf.st_size == expectedSize;
+    
+    if (found) {
+        size = std::min(size, expectedSize);
+        char* out = static_cast<char*>(buffer);
+        while (bytesRead < size) {
+            ssize_t ret = pread(fd, out + bytesRead, size - bytesRead, bytesRead);
+            if (ret <= 0) break;
+            bytesRead += ret;
+        }
+        found = (bytesRead == size);
+        
+        // a truncated or corrupted file of the right size is deleted
+        if (found && !verified) {
+            uLong crc = crc32(crc32(0L, Z_NULL, 0), static_cast<const Bytef*>(buffer), (uInt)bytesRead);
+            verified = crcFileTail(fd, bytesRead, expectedSize, crc) == expectedCrc;
+            if (!verified) {
+                deleted = unlink(filePath.c_str()) == 0;
+                found = false;
+                bytesRead = 0;
+            }
+        }
+        
+        // mtime is the recency used by eviction
+        if (found)
+            futimes(fd, nullptr);
+    }
+    
+    if (fd >= 0)
+        close(fd);
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    if (deleted) {
+        stats.usedBytes -= std::min(expectedSize, stats.usedBytes);
+        if (stats.entriesCount > 0)
+            stats.entriesCount--;
+    }
+    if (found) {
+        verifiedKeys.insert(key);
+        stats.hits++;
+    }
+    else {
+        stats.misses++;
+    }
+    return found;
+}
+
+void DiskCache::write(const std::string& key, const void* data, size_t size) {
+    std::string filePath, tempFilePath;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (folder.empty() || size > budget) {
+            stats.rejections++;
+            return;
+        }
+        
+        filePath = folder + "/" + key;
+        tempFilePath = filePath + "-" + std::to_string(getpid()) + "-" + std::to_string(tempFilesCount++) + tempFileSuffix;
+    }
+    
+    int fd = open(tempFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    
+    const char* in = static_cast<const char*>(data);
+    size_t bytesWritten = 0;
+    while (bytesWritten < size) {
+        ssize_t ret = ::write(fd, in + bytesWritten, size - bytesWritten);
+        if (ret <= 0) break;
+        bytesWritten += ret;
+    }
+    close(fd);
+    
+    // a file replaced by the rename no longer counts
+    struct stat stat_buf;
+    bool replaces = stat(filePath.c_str(), &stat_buf) == 0 && S_ISREG(stat_buf.st_mode);
+    size_t replacedSize = replaces ? stat_buf.st_size : 0;
+    
+    // another process may have written the same file, either copy is complete
+    if (bytesWritten != size || rename(tempFilePath.c_str(), filePath.c_str()) != 0) {
+        unlink(tempFilePath.c_str());
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        verifiedKeys.insert(key);
+        stats.insertions++;
+        stats.usedBytes = stats.usedBytes + size - std::min(replacedSize, stats.usedBytes);
+        if (!replaces)
+            stats.entriesCount++;
+        if (stats.usedBytes <= budget || evicting) return;
+    }
+    
+    evict();
+}
+
+// Rescans the folder without the lock, other processes write to it too, deletes
+// stale temporary files and the least recently used files down to 90% of the budget.
+void DiskCache::evict() {
+    std::string folder;
+    size_t budget;
+    unsigned generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        folder = this->folder;
+        budget = this->budget;
+        generation = this->generation;
+        evicting = true;
+    }
+    
+    DIR* dir = opendir(folder.c_str());
+    if (!dir) {
+        std::lock_guard<std::mutex> lock(mutex);
+        evicting = false;
+        return;
+    }
+    
+    time_t now = time(nullptr);
+    
+    struct CachedFile {
+        std::string path;
+        size_t size;
+        time_t modificationTime;
+    };
+    std::vector<CachedFile> files;
+    size_t usedBytes = 0;
+    size_t evictedCount = 0;
+    
+    while (struct dirent* entry = readdir(dir)) {
+        std::string filename = entry->d_name;
+        size_t keyLength = matchKey(filename);
+        bool isTempFile = keyLength > 0 && keyLength < filename.size() && filename[keyLength] == '-' && hasTempFileSuffix(filename);
+        if (keyLength != filename.size() && !isTempFile) continue;
+        
+        CachedFile file;
+        file.path = folder + "/" + filename;
+        
+        struct stat stat_buf;
+        if (stat(file.path.c_str(), &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode)) continue;
+        
+        if (isTempFile) {
+            if (now - stat_buf.st_mtime > tempFileMaximumAge)
+                unlink(file.path.c_str());
+            continue;
+        }
+        
+        file.size = stat_buf.st_size;
+        file.modificationTime = stat_buf.st_mtime;
+        files.push_back(file);
+        usedBytes += file.size;
+    }
+    closedir(dir);
+    
+    if (usedBytes > budget) {
+        std::sort(files.begin(), files.end(), [](const CachedFile& a, const CachedFile& b) {
+            return a.modificationTime < b.modificationTime;
+        });
+        
+        size_t targetBytes = budget / 10 * 9;
+        for (auto& file : files) {
+            if (usedBytes <= targetBytes) break;
+            
+            if (unlink(file.path.c_str()) == 0) {
+                usedBytes -= file.size;
+                evictedCount++;
+            }
+        }
+    }
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    evicting = false;
+    if (generation != this->generation) return;
+    
+    stats.evictions += evictedCount;
+    stats.usedBytes = usedBytes;
+    stats.entriesCount = files.size() - evictedCount;
+}
+
+ContentCacheStats DiskCache::getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
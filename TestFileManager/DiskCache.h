@@ -0,0 +1,54 @@
+//
+//  DiskCache.h
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <string>
+#include <set>
+#include <mutex>
+#include <stdint.h>
+
+#include "ContentCache.h"
+
+// Folder of extracted files shared by processes and kept across runs. Files are
+// written under a temporary name and renamed into place, so readers never see
+// a partial file. When over budget, the least recently used files are deleted.
+// Keys are extracted keys ("<archive>-<crc>-<size>"), other files in the folder
+// are left alone.
+class DiskCache
+{
+public:
+    DiskCache();
+    
+    // empty folder disables the cache
+    void setFolder(const std::string& folder, size_t budget);
+    bool isEnabled();
+    
+    // False on a miss, a partial read if size is smaller than expectedSize. The first
+    // hit of a key in a session checks the whole file against expectedCrc and deletes
+    // it on a mismatch.
+    bool read(const std::string& key, size_t expectedSize, uint32_t expectedCrc, void* buffer, size_t size, size_t& bytesRead);
+    void write(const std::string& key, const void* data, size_t size);
+    
+    ContentCacheStats getStats();
+    
+private:
+    std::string folder;
+    size_t budget;
+    ContentCacheStats stats;    // usedBytes and entriesCount as of the last scan plus writes
+    std::set<std::string> verifiedKeys;
+    unsigned tempFilesCount;
+    unsigned generation;        // bumped by setFolder, a scan of an older folder is dropped
+    bool evicting;
+    std::mutex mutex;
+    
+    void evict();
+    
+    DiskCache(const DiskCache&);
+    DiskCache &operator=(const DiskCache&);
+};
@@ -0,0 +1,113 @@
+//
+//  FileDescriptorCache.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#include "FileDescriptorCache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+
+FileDescriptorCache::Descriptor::~Descriptor() {
+    close(fd);
+}
+
+FileDescriptorCache::FileDescriptorCache(size_t maxOpenFiles) {
+    setMaxOpenFiles(maxOpenFiles);
+}
+
+std::shared_ptr<FileDescriptorCache::Descriptor> FileDescriptorCache::acquire(const std::string& filePath) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        
+        auto it = descriptorsMap.find(filePath);
+        if (it != descriptorsMap.end()) {
+            descriptors.splice(descriptors.begin(), descriptors, it->second);
+            return it->second->second;
+        }
+    }
+    
+    // open without holding the lock, other files stay readable meanwhile
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    
+    std::shared_ptr<Descriptor> descriptor = std::make_shared<Descriptor>(fd);
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    if (maxOpenFiles == 0) return descriptor;
+    
+    // another thread may have opened the same file
+    auto it = descriptorsMap.find(filePath);
+    if (it != descriptorsMap.end()) {
+        descriptors.splice(descriptors.begin(), descriptors, it->second);
+        return it->second->second;
+    }
+    
+    descriptors.push_front(std::make_pair(filePath, descriptor));
+    descriptorsMap[filePath] = descriptors.begin();
+    evictExcess();
+    
+    return descriptor;
+}
+
+void FileDescriptorCache::invalidate(const std::string& filePath) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    auto it = descriptorsMap.find(filePath);
+    if (it == descriptorsMap.end()) return;
+    
+    descriptors.erase(it->second);
+    descriptorsMap.erase(it);
+}
+
+void FileDescriptorCache::invalidateFolder(const std::string& folderPath) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    std::string prefix = folderPath;
+    if (!prefix.empty() && prefix.back() != '/')
+        prefix += '/';
+    
+    auto it = descriptorsMap.lower_bound(prefix);
+    while (it != descriptorsMap.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        descriptors.erase(it->second);
+        it = descriptorsMap.erase(it);
+    }
+}
+
+void FileDescriptorCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    descriptors.clear();
+    descriptorsMap.clear();
+}
+
+void FileDescriptorCache::setMaxOpenFiles(size_t maxOpenFiles) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    // leave most of the process budget to the rest of the app
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        maxOpenFiles = std::min<size_t>(maxOpenFiles, limit.rlim_cur / 4);
+    
+    this->maxOpenFiles = maxOpenFiles;
+    evictExcess();
+}
+
+size_t FileDescriptorCache::getOpenFilesCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return descriptors.size();
+}
+
+void FileDescriptorCache::evictExcess() {
+    while (descriptors.size() > maxOpenFiles) {
+        descriptorsMap.erase(descriptors.back().first);
+        descriptors.pop_back();
+    }
+}
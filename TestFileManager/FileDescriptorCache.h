@@ -0,0 +1,61 @@
+//
+//  FileDescriptorCache.h
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <string>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// Bounded LRU of read-only file descriptors keyed by file path, for pread.
+// An evicted or invalidated descriptor stays open until its last user releases it.
+class FileDescriptorCache
+{
+public:
+    class Descriptor {
+    public:
+        explicit Descriptor(int fd) : fd(fd) {}
+        ~Descriptor();
+        
+        int get() const { return fd; }
+        
+    private:
+        int fd;
+        
+        Descriptor(const Descriptor&);
+        Descriptor &operator=(const Descriptor&);
+    };
+    
+    explicit FileDescriptorCache(size_t maxOpenFiles);
+    
+    // nullptr if the file can't be opened
+    std::shared_ptr<Descriptor> acquire(const std::string& filePath);
+    
+    void invalidate(const std::string& filePath);
+    void invalidateFolder(const std::string& folderPath);   // every file below the folder
+    void clear();
+    
+    // clamped to a quarter of the process descriptor limit
+    void setMaxOpenFiles(size_t maxOpenFiles);
+    size_t getOpenFilesCount();
+    
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<Descriptor>>> DescriptorList;
+    
+    DescriptorList descriptors;     // most recently used first
+    std::map<std::string, DescriptorList::iterator> descriptorsMap;
+    size_t maxOpenFiles;
+    std::mutex mutex;
+    
+    void evictExcess();
+    
+    FileDescriptorCache(const FileDescriptorCache&);
+    FileDescriptorCache &operator=(const FileDescriptorCache&);
+};
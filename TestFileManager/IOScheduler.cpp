@@ -0,0 +1,125 @@
+//
+//  IOScheduler.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#include "IOScheduler.h"
+
+IOScheduler::IOScheduler(size_t threadsCount) :
+    lastSequence(0),
+    stopping(false)
+{
+    for (int i = 0; i < IOPrioritiesCount; i++) {
+        inFlightBytes[i] = 0;
+    }
+    inFlightLimits[IOPriorityUrgent]   = SIZE_MAX;
+    inFlightLimits[IOPriorityNormal]   = 64 * 1024 * 1024;
+    inFlightLimits[IOPriorityPrefetch] = 8 * 1024 * 1024;
+    
+    if (threadsCount == 0) threadsCount = 1;
+    
+    for (size_t i = 0; i < threadsCount; i++) {
+        threads.push_back(std::thread(&IOScheduler::workerLoop, this));
+    }
+}
+
+IOScheduler::~IOScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    
+    // queued requests are still run or dropped before the workers exit
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void IOScheduler::enqueue(IOPriority priority, size_t bytes, TimePoint deadline,
+                          const std::shared_ptr<const ReadCancellation>& cancellation, const Task& read, const Task& drop /* = nullptr */) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        
+        Request& request = queues[priority][RequestOrder(deadline, ++lastSequence)];
+        request.bytes = bytes;
+        request.cancellation = cancellation;
+        request.read = read;
+        request.drop = drop;
+    }
+    condition.notify_one();
+}
+
+void IOScheduler::setInFlightLimit(IOPriority priority, size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        inFlightLimits[priority] = bytes;
+    }
+    condition.notify_all();
+}
+
+size_t IOScheduler::getInFlightBytes(IOPriority priority) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return inFlightBytes[priority];
+}
+
+size_t IOScheduler::getQueuedCount(IOPriority priority) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queues[priority].size();
+}
+
+// The first request of the most urgent class under its limit. A class with nothing
+// in flight always starts its next request, however large.
+bool IOScheduler::takeRequest(IOPriority& priority, Request& request, bool& dropped) {
+    TimePoint now = std::chrono::steady_clock::now();
+    
+    for (int i = 0; i < IOPrioritiesCount; i++) {
+        auto& queue = queues[i];
+        if (queue.empty()) continue;
+        
+        auto it = queue.begin();
+        dropped = it->first.first < now || (it->second.cancellation && it->second.cancellation->isCancelled());
+        if (!dropped && inFlightBytes[i] > 0 && inFlightBytes[i] + it->second.bytes > inFlightLimits[i]) continue;
+        
+        priority = IOPriority(i);
+        request = std::move(it->second);
+        queue.erase(it);
+        if (!dropped)
+            inFlightBytes[i] += request.bytes;
+        return true;
+    }
+    
+    return false;
+}
+
+void IOScheduler::workerLoop() {
+    for (;;) {
+        IOPriority priority;
+        Request request;
+        bool dropped = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!takeRequest(priority, request, dropped)) {
+                if (stopping && queues[IOPriorityUrgent].empty() && queues[IOPriorityNormal].empty() && queues[IOPriorityPrefetch].empty()) return;
+                condition.wait(lock);
+            }
+        }
+        
+        if (dropped) {
+            if (request.drop) request.drop();
+            continue;
+        }
+        
+        request.read();
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            inFlightBytes[priority] -= request.bytes;
+        }
+        // a class may be under its limit again
+        condition.notify_all();
+    }
+}
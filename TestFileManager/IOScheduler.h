@@ -0,0 +1,89 @@
+//
+//  IOScheduler.h
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <stdint.h>
+
+enum IOPriority {
+    IOPriorityUrgent,       // a caller is blocked on it
+    IOPriorityNormal,
+    IOPriorityPrefetch,     // speculative, may be late or dropped
+    IOPrioritiesCount
+};
+
+// Cancels the reads it was passed to that haven't started yet, they complete
+// without a result. A read already running completes normally.
+class ReadCancellation {
+public:
+    ReadCancellation() : cancelled(false) {}
+    
+    void cancel() { cancelled = true; }
+    bool isCancelled() const { return cancelled; }
+    
+private:
+    std::atomic<bool> cancelled;
+};
+
+// Worker threads running reads by priority class, urgent reads first. Within a class
+// the earliest deadline goes first, then the oldest request. Requests not started by
+// their deadline or cancelled before are dropped. A class with requests in flight
+// doesn't start more than its limit of bytes, so prefetches can't flood the device.
+class IOScheduler
+{
+public:
+    typedef std::function<void()> Task;
+    typedef std::chrono::steady_clock::time_point TimePoint;
+    
+    explicit IOScheduler(size_t threadsCount);
+    ~IOScheduler();
+    
+    // Runs read, or drop instead if the request is dropped. bytes is what it will
+    // read, counted against the class limit while read runs.
+    void enqueue(IOPriority priority, size_t bytes, TimePoint deadline,
+                 const std::shared_ptr<const ReadCancellation>& cancellation, const Task& read, const Task& drop = nullptr);
+    
+    void setInFlightLimit(IOPriority priority, size_t bytes);
+    size_t getInFlightBytes(IOPriority priority);
+    size_t getQueuedCount(IOPriority priority);
+    
+    static TimePoint noDeadline() { return TimePoint::max(); }
+    
+private:
+    struct Request {
+        size_t bytes;
+        std::shared_ptr<const ReadCancellation> cancellation;
+        Task read;
+        Task drop;
+    };
+    typedef std::pair<TimePoint, uint64_t> RequestOrder;      // deadline, sequence
+    
+    std::vector<std::thread> threads;
+    std::map<RequestOrder, Request> queues[IOPrioritiesCount];
+    size_t inFlightBytes[IOPrioritiesCount];
+    size_t inFlightLimits[IOPrioritiesCount];
+    uint64_t lastSequence;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping;
+    
+    void workerLoop();
+    bool takeRequest(IOPriority& priority, Request& request, bool& dropped);
+    
+    IOScheduler(const IOScheduler&);
+    IOScheduler &operator=(const IOScheduler&);
+};
@@ -0,0 +1,92 @@
+//
+//  ReadArena.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#include "ReadArena.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+ReadArena::ReadArena(size_t chunkSize) :
+    chunkSize(chunkSize ? chunkSize : 1),
+    chunkOffset(0),
+    allocatedSize(0)
+{
+}
+
+ReadArena::~ReadArena() {
+    for (auto& chunk : chunks) {
+        delete[] chunk.data;
+    }
+}
+
+void* ReadArena::allocate(size_t size, size_t alignment /* = 16 */) {
+    if (!chunks.empty()) {
+        Chunk& chunk = chunks.back();
+        uintptr_t begin = reinterpret_cast<uintptr_t>(chunk.data) + chunkOffset;
+        size_t padding = (alignment - begin % alignment) % alignment;
+        
+        if (chunkOffset + padding + size <= chunk.size) {
+            chunkOffset += padding + size;
+            allocatedSize += size;
+            return reinterpret_cast<void*>(begin + padding);
+        }
+    }
+    
+    // new chunk, large buffers get one of their own size
+    Chunk chunk;
+    chunk.size = std::max(chunkSize, size + alignment);
+    chunk.data = new char[chunk.size];
+    chunks.push_back(chunk);
+    
+    uintptr_t begin = reinterpret_cast<uintptr_t>(chunk.data);
+    size_t padding = (alignment - begin % alignment) % alignment;
+    chunkOffset = padding + size;
+    allocatedSize += size;
+    return reinterpret_cast<void*>(begin + padding);
+}
+
+void ReadArena::reset() {
+    if (chunks.size() > 1) {
+        auto largest = std::max_element(chunks.begin(), chunks.end(), [](const Chunk& a, const Chunk& b) {
+            return a.size < b.size;
+        });
+        std::swap(*largest, chunks.front());
+        
+        for (size_t i = 1; i < chunks.size(); i++) {
+            delete[] chunks[i].data;
+        }
+        chunks.resize(1);
+    }
+    
+    chunkOffset = 0;
+    allocatedSize = 0;
+}
+
+static pthread_key_t threadArenaKey;
+static pthread_once_t threadArenaKeyOnce = PTHREAD_ONCE_INIT;
+
+static void deleteThreadArena(void* arena) {
+    delete static_cast<ReadArena*>(arena);
+}
+
+static void createThreadArenaKey() {
+    pthread_key_create(&threadArenaKey, deleteThreadArena);
+}
+
+ReadArena& ReadArena::threadArena() {
+    pthread_once(&threadArenaKeyOnce, createThreadArenaKey);
+    
+    ReadArena* arena = static_cast<ReadArena*>(pthread_getspecific(threadArenaKey));
+    if (!arena) {
+        arena = new ReadArena();
+        pthread_setspecific(threadArenaKey, arena);
+    }
+    return *arena;
+}
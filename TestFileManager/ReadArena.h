@@ -0,0 +1,44 @@
+//
+//  ReadArena.h
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Bump allocator for short-lived read buffers, e.g. everything loaded in a frame.
+// Memory is only given back all at once by reset(), which keeps the largest chunk
+// so a steady workload stops allocating. Not thread safe, use one arena per thread.
+class ReadArena
+{
+public:
+    explicit ReadArena(size_t chunkSize = 1024 * 1024);
+    ~ReadArena();
+    
+    void* allocate(size_t size, size_t alignment = 16);
+    void reset();
+    
+    size_t getAllocatedSize() const { return allocatedSize; }   // handed out since the last reset
+    
+    // arena of the calling thread, destroyed with the thread
+    static ReadArena& threadArena();
+    
+private:
+    struct Chunk {
+        char* data;
+        size_t size;
+    };
+    
+    std::vector<Chunk> chunks;      // the last one is being filled
+    size_t chunkSize;
+    size_t chunkOffset;
+    size_t allocatedSize;
+    
+    ReadArena(const ReadArena&);
+    ReadArena &operator=(const ReadArena&);
+};
@@ -0,0 +1,78 @@
+//
+//  ResourceAwaitables.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#include "ResourceAwaitables.h"
+
+#ifdef RESOURCES_MANAGER_COROUTINES
+
+void ResourceAwaitable::await_suspend(std::coroutine_handle<> handle) {
+    this->handle = handle;
+    
+    // a dropped read resumes the coroutine without a result
+    ResourcesManager::sharedManager()->enqueueRead(options, getReadBytes(), [this] { run(); }, [this] { resume(); });
+}
+
+void ResourceAwaitable::run() {
+    if (!options.cancellation || !options.cancellation->isCancelled()) {
+        started = true;
+        try {
+            read();
+        }
+        catch (...) {
+            exception = std::current_exception();
+        }
+    }
+    
+    resume();
+}
+
+void ResourceAwaitable::resume() {
+    if (executor)
+        executor->resume(handle);
+    else
+        handle.resume();
+}
+
+bool ResourceAwaitable::checkResult() {
+    if (exception) std::rethrow_exception(exception);
+    return started;
+}
+
+size_t ResourceReadAwaitable::getReadBytes() {
+    return manager->getReadBytes(filename);
+}
+
+void ResourceReadAwaitable::read() {
+    blob = manager->readShared(filename);
+}
+
+ResourceBlob ResourceReadAwaitable::await_resume() {
+    if (!checkResult()) return ResourceBlob();
+    return std::move(blob);
+}
+
+void StreamReadAwaitable::read() {
+    bytesRead = stream->readData(buffer, size);
+}
+
+size_t StreamReadAwaitable::await_resume() {
+    if (!checkResult()) return 0;
+    return bytesRead;
+}
+
+ResourceReadAwaitable ResourcesManager::read(const std::string& filename, CoroutineExecutor* executor /* = nullptr */,
+                                             const ReadOptions& options /* = ReadOptions() */) {
+    return ResourceReadAwaitable(this, filename, executor, options);
+}
+
+StreamReadAwaitable Stream::read(void* buffer, int size, CoroutineExecutor* executor /* = nullptr */,
+                                 const ReadOptions& options /* = ReadOptions() */) {
+    return StreamReadAwaitable(this, buffer, size, executor, options);
+}
+
+#endif
@@ -0,0 +1,102 @@
+//
+//  ResourceAwaitables.h
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include "ResourcesManager.h"
+
+#ifdef RESOURCES_MANAGER_COROUTINES
+
+#include <coroutine>
+#include <exception>
+
+// Where coroutines awaiting a read are resumed, e.g. the service's event loop.
+// Without an executor they resume on the read thread that completed the read.
+class CoroutineExecutor {
+public:
+    virtual ~CoroutineExecutor() {}
+    virtual void resume(std::coroutine_handle<> handle) = 0;
+};
+
+// Suspends the awaiting coroutine while the read runs on the manager's read threads.
+// The awaitable's state lives in the coroutine frame.
+// The read is scheduled with the options' priority, deadline and cancellation.
+class ResourceAwaitable {
+public:
+    bool await_ready() const noexcept { return options.cancellation && options.cancellation->isCancelled(); }
+    void await_suspend(std::coroutine_handle<> handle);
+    
+protected:
+    ResourceAwaitable(CoroutineExecutor* executor, const ReadOptions& options)
+        : executor(executor), options(options), started(false) {}
+    virtual ~ResourceAwaitable() {}
+    
+    virtual size_t getReadBytes() = 0;  // counted against the priority class limit
+    virtual void read() = 0;            // on the read thread
+    
+    // rethrows what the read threw, false if it was cancelled before it started
+    bool checkResult();
+    
+private:
+    friend class ResourcesManager;
+    
+    CoroutineExecutor* executor;
+    ReadOptions options;
+    std::coroutine_handle<> handle;
+    std::exception_ptr exception;
+    bool started;
+    
+    void run();
+    void resume();
+    
+    ResourceAwaitable(const ResourceAwaitable&) = delete;
+    ResourceAwaitable &operator=(const ResourceAwaitable&) = delete;
+};
+
+// co_await manager->read(name), an invalid blob if missing or cancelled
+class ResourceReadAwaitable : public ResourceAwaitable {
+public:
+    ResourceBlob await_resume();
+    
+private:
+    friend class ResourcesManager;
+    
+    ResourceReadAwaitable(ResourcesManager* manager, const std::string& filename,
+                          CoroutineExecutor* executor, const ReadOptions& options)
+        : ResourceAwaitable(executor, options), manager(manager), filename(filename) {}
+    
+    size_t getReadBytes() override;
+    void read() override;
+    
+    ResourcesManager* manager;
+    std::string filename;
+    ResourceBlob blob;
+};
+
+// co_await stream->read(buffer, size), the bytes read, 0 if cancelled
+class StreamReadAwaitable : public ResourceAwaitable {
+public:
+    size_t await_resume();
+    
+private:
+    friend class Stream;
+    
+    StreamReadAwaitable(Stream* stream, void* buffer, int size,
+                        CoroutineExecutor* executor, const ReadOptions& options)
+        : ResourceAwaitable(executor, options), stream(stream), buffer(buffer), size(size), bytesRead(0) {}
+    
+    size_t getReadBytes() override { return size; }
+    void read() override;
+    
+    Stream* stream;
+    void* buffer;
+    int size;
+    size_t bytesRead;
+};
+
+#endif
@@ -9,18 +9,37 @@
 #include "ResourcesManager.h"
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include <vector>
+#include <list>
 #include <set>
 #include <map>
 #include <sstream>
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #include "unzip.h"
+#include "iommap.h"
+#include "ThreadPool.h"
+#include "IOScheduler.h"
+#include "FileDescriptorCache.h"
+#include "ContentCache.h"
+#include "DiskCache.h"
+#include "SharedMemoryCache.h"
+#include "AccessPredictor.h"
 
 enum FileType {
     RegularFile, CompressedFile, StoredFile
@@ -36,16 +55,34 @@ struct FileRecord {
     // regular file
     std::string filePath;     // /Users/user/../<AppId>/res/Textures/Demo.png
     std::string relativePath; // res/textures/Demo.png
+    long modificationTime = 0;
+    long modificationTimeNsec = 0;
     
     // zip
-    std::string zipFilePath;
+    std::shared_ptr<const std::string> zipFilePath;   // shared by all records of the archive
     unz_file_pos zipFilePos;
+    uint64_t zipArchiveIdentity = 0;                   // device, inode, size and mtime of the archive
+    uint64_t zipLocalHeaderOffset = 0;                 // from the start of the archive file
+    uint64_t zipCompressedSize = 0;
+    uint32_t zipCrc = 0;
+    uint16_t zipCompressionMethod = 0;
+    bool zipEncrypted = false;
+    
+    // index
+    unsigned mountId = 0;           // later mounts shadow earlier ones
+    bool shadowsFileRecord = false; // replaced another record of its mount in the index
+    
+    // inflated contents of a pinned record, read without I/O
+    std::shared_ptr<const char> pinnedContents;
 };
 
 struct StreamRecord {
-    FileRecord* fileRecord;
+    FileRecord fileRecord;    // copy, the record's mount may be removed while the stream is open
     int randomValue;
     
+    // guards the handles below, stream I/O runs without the manager lock
+    std::mutex mutex;
+    
     // regular file
     FILE* file;
     
@@ -57,17 +94,53 @@ struct StreamRecord {
     }
 };
 
+typedef std::list<FileRecord> FileRecordList;
+
+struct FolderRecord {
+    // identity of the folder at the time it was last enumerated
+    dev_t device;
+    ino_t inode;
+    long modificationTime;
+    long modificationTimeNsec;
+    
+    std::vector<std::string> subfolders;              // sorted
+    std::vector<FileRecordList::iterator> fileRecords; // sorted by filename
+};
+
+struct MountRecord {
+    unsigned mountId = 0;
+    
+    std::string rootFolder;                           // root folder mount
+    std::string archivePath;                          // archive mount
+    std::string archiveRootFolder;
+    MountFilter filter;
+    
+    FileRecordList fileRecords;
+    std::map<std::string, FolderRecord> folders;      // root folder mount: relative folder -> record
+    std::map<std::string, FileRecord*> index;         // this mount's shard of the index
+    
+    bool mounted = false;                             // records are committed and indexed
+    bool pending = false;                             // scan is in progress
+    std::shared_future<void> future;
+    std::shared_ptr<MountProgress> progress;
+};
+
+class BatchLatch;
+
 class ResourcesManagerImpl {
 private:
     friend class ResourcesManager;
     
-    typedef std::vector<FileRecord> FileRecordList;
-    
     bool enableTrace;
     
-    std::vector<std::string> rootFoldersList;
+    // guards all state below, public methods lock it
+    std::recursive_mutex mutex;
+    
+    std::list<MountRecord> mountsList;
+    unsigned lastMountId = 0;
+    size_t pendingMountsCount = 0;
+    std::unique_ptr<ThreadPool> mountThreadPool;
     
-    FileRecordList fileRecordList;
     std::map<std::string, FileRecord*> fileRecordIndex;
     
     bool shouldRebuildIndex;
@@ -76,19 +149,217 @@ private:
     std::map<std::string, std::string> relativeFolderToCategoryMap;
     std::set<std::string> enabledCategories;
     
-    std::map<int, StreamRecord> openStreams;
+    // lowercase dictionaries prepared by rebuildIndex
+    std::map<std::string, std::string> lowercaseFolderToCategoryMap;
+    std::vector<std::string> lowercaseSearchRootsList;
+    
+    std::map<int, std::shared_ptr<StreamRecord>> openStreams;
     bool searchByRelativePaths;
     std::vector<std::string> searchRootsList;
     
-    std::map<std::string, unzFile> sharedZipFiles;
+    // Handles of an archive, a reader takes an idle one or opens another,
+    // so reads of one archive run in parallel.
+    struct SharedZipFile {
+        std::vector<unzFile> idleZipFiles;
+        int busyCount = 0;                // handles taken by reads
+        int streamsCount = 0;             // open streams of the archive's records
+        bool closeWhenUnused = false;     // archive was removed while streams or reads were open
+    };
+    std::map<std::string, SharedZipFile> sharedZipFiles;
+    std::mutex sharedZipFilesMutex;       // guards sharedZipFiles, reads don't hold the main mutex
+    
+    // handle taken for one read, given back when it goes out of scope
+    struct SharedZipLease {
+        ResourcesManagerImpl* impl;
+        const std::string& archivePath;
+        unzFile zipFile;
+        
+        SharedZipLease(ResourcesManagerImpl* impl, const std::string& archivePath)
+            : impl(impl), archivePath(archivePath), zipFile(impl->acquireSharedZip(archivePath)) {}
+        ~SharedZipLease() { impl->releaseSharedZip(archivePath, zipFile); }
+    };
+    
+    // Whole file reads in progress by content key. Readers of a key that is
+    // already being read wait for the first one and get its result.
+    struct ReadFlight {
+        std::promise<ResourceBlob> promise;
+        std::shared_future<ResourceBlob> future;
+        size_t waitersCount = 0;
+        std::thread::id leaderThreadId;
+    };
+    std::map<std::string, std::shared_ptr<ReadFlight>> readFlights;
+    std::mutex readFlightsMutex;
+    
+    // read-only mapping of a whole file, backs resource views
+    struct FileMapping {
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+        ~FileMapping();
+        static std::shared_ptr<FileMapping> create(const std::string& filePath);
+    };
+    std::map<std::string, std::shared_ptr<FileMapping>> archiveMappings;
+    
+    // descriptors of recently read regular files
+    FileDescriptorCache fileDescriptorCache { defaultMaxOpenFiles };
+    static const size_t defaultMaxOpenFiles = 32;
+    
+    // inflated contents in front of readData
+    ContentCache contentCache { 0 };
+    ContentCacheOptions contentCacheOptions;
+    
+    // contents handed out by readShared, shared while any handle is alive
+    struct SharedBlob {
+        std::weak_ptr<const char> data;
+        size_t size;
+        ResourceBacking backing;
+    };
+    std::map<std::string, SharedBlob> sharedBlobs;
+    size_t sharedBlobsSweepSize = 64;
+    
+    // pinned contents by content key, kept out of the content cache budget
+    struct PinnedFile {
+        std::shared_ptr<const char> contents;
+        size_t size;
+        int pinCount;
+    };
+    std::map<std::string, PinnedFile> pinnedFiles;
+    size_t pinnedSize = 0;
+    size_t pinnedBudget;
+    
+    // raw deflate payloads of entries too large for the content cache
+    ContentCache compressedCache { 0 };
+    
+    // inflated entries extracted to local disk, shared with other processes
+    DiskCache diskCache;
+    size_t diskCacheMinimumSize = 0;
+    
+    // inflated entries shared with the other processes of the host
+    SharedMemoryCache sharedMemoryCache;
+    
+    MapAdvice mapAdvice;
+    size_t minimumMappedSize;                 // smaller regular files are read into the heap
+    
+    // Asynchronous reads do their I/O on the read threads, deflated entries are
+    // inflated on the inflate threads so a read thread is free once the raw bytes are in.
+    struct AsyncRead {
+        FileRecord fileRecord;
+        void* buffer = nullptr;               // caller's, nullptr for a blob
+        int size = 0;
+        std::promise<size_t> sizePromise;
+        std::promise<ResourceBlob> blobPromise;
+        std::function<void(bool loaded)> completion;   // instead of the promises
+        bool cacheOnly = false;               // a prefetch, only fills the content cache
+    };
+    std::unique_ptr<IOScheduler> ioScheduler;
+    std::shared_ptr<ThreadPool> inflateThreadPool;   // replaced while callers may hold it
+    size_t inflateThreadsCount = 0;
+    std::vector<int> inflateThreadsCpus;
+    
+    // read without the lock by every read, replaced as a whole
+    std::shared_ptr<AccessPredictor> accessPredictor;
+    std::string accessPredictorFile;
+    std::atomic<bool> accessPredictorInflates;
+    
+    // Files of a preload manifest, records reachable through several names are loaded once.
+    struct Preload {
+        std::vector<PreloadItem> items;
+        std::mutex itemsMutex;
+        std::atomic<size_t> remainingLoadsCount;
+        std::promise<std::vector<PreloadItem>> promise;
+    };
+    struct PreloadLoad {
+        FileRecord fileRecord;
+        std::string name;                     // the first item naming it
+        std::vector<size_t> itemIndices;
+    };
     
     // methods    
-    void addFolderRecursive(const std::string& folder, const std::string& relativeFolder);
+    std::shared_future<void> mount(const std::string& rootFolder, const std::string& archivePath, const std::string& archiveRootFolder,
+                                   const MountFilter& filter, const std::string& scanStateFile,
+                                   const std::shared_ptr<MountProgress>& progress, bool async);
+    void runMount(std::shared_ptr<MountRecord> scannedMountRecord, const std::string& scanStateFile, std::shared_ptr<std::promise<void>> promise);
+    void commitMount(MountRecord& scannedMountRecord);
+    void waitForMounts(const std::string& filename);
+    void waitForAllMounts();
+    std::vector<std::shared_future<void>> getPendingMounts();
+    void waitForPendingMounts(const std::string& rootFolder, const std::string& archivePath);
+    void removeMounts(const std::string& rootFolder, const std::string& archivePath);
+    void removeMount(std::list<MountRecord>::iterator mountRecordIt);
+    
+    MountRecord* findMountRecord(const std::string& rootFolder);
+    void addFolderRecursive(MountRecord& mountRecord, const std::string& relativeFolder);
+    void rescanFolderRecursive(MountRecord& mountRecord, const std::string& relativeFolder);
+    void refreshFileRecord(FileRecord& fileRecord, bool force = false);
+    void removeFolderRecursive(MountRecord& mountRecord, const std::string& relativeFolder);
+    FileRecordList::iterator addRegularFileRecord(MountRecord& mountRecord, const std::string& relativeFolder, const std::string& filename);
+    void removeFileRecord(MountRecord& mountRecord, FileRecordList::iterator fileRecordIt);
+    void scanArchive(MountRecord& mountRecord);
+    bool saveScanState(const MountRecord& mountRecord, const std::string& scanStateFile);
+    bool loadScanState(MountRecord& mountRecord, const std::string& scanStateFile);
     
     size_t readData(const FileRecord& fileRecord, void* buffer, int size);
+    size_t readDataUncached(const FileRecord& fileRecord, void* buffer, int size);
+    size_t readDataThroughCompressedCache(const FileRecord& fileRecord, void* buffer, int size);
+    size_t readDataFromArchive(const FileRecord& fileRecord, void* buffer, int size);
+    std::string makeExtractedKey(const FileRecord& fileRecord);
+    std::shared_ptr<const char> readRawData(const FileRecord& fileRecord);
+    bool shouldCacheContents(const FileRecord& fileRecord);
+    std::string makeContentKey(const FileRecord& fileRecord);
+    void invalidateCachedFile(const FileRecord& fileRecord);
     size_t readDataFromRegularFile(const std::string& filePath, void* buffer, int size);
-    unzFile openSharedZip(const std::string& archivePath);
+    unzFile acquireSharedZip(const std::string& archivePath);
+    void releaseSharedZip(const std::string& archivePath, unzFile zipFile);
     void closeSharedZip(const std::string& archivePath);
+    std::shared_ptr<FileMapping> mapArchive(const std::string& archivePath);
+    ResourceView readView(const FileRecord& fileRecord);
+    ResourceView map(const FileRecord& fileRecord, bool* mapped = nullptr);
+    ResourceBlob readShared(const FileRecord& fileRecord);
+    enum PinResult { PinResultPinned, PinResultMissing, PinResultOverBudget, PinResultFailed };
+    PinResult pin(const std::string& filename, const FileRecord& fileRecord);
+    void unpin(FileRecord& fileRecord);
+    bool reloadPinnedFile(FileRecord& fileRecord);
+    bool addPin(FileRecord& fileRecord);
+    bool addPinnedFile(FileRecord& fileRecord, const std::shared_ptr<char>& contents, size_t size);
+    void removePinnedFile(const std::string& key);
+    void releasePinnedFile(const std::string& key);
+    std::vector<FileRecord*> findPinnedFileRecords(const std::string& key);
+    ResourceView readIntoView(const FileRecord& fileRecord);
+    void retainSharedZip(const std::string& archivePath);
+    void releaseSharedZip(const std::string& archivePath);
+    
+    ResourceBlob findSharedBlob(const std::string& key);
+    void addSharedBlob(const std::string& key, const ResourceBlob& blob);
+    std::shared_ptr<ReadFlight> joinReadFlight(const std::string& key, bool& leader);
+    size_t leaveReadFlight(const std::string& key);
+    ResourceBlob readSharedContents(const FileRecord& fileRecord, const std::string& key);
+    bool copyFileRecord(const std::string& filename, FileRecord& fileRecord);
+    
+    IOScheduler& getIOScheduler();
+    std::shared_ptr<ThreadPool> getInflateThreadPool();
+    void startAsyncRead(std::shared_ptr<AsyncRead> asyncRead, const std::string& filename, const ReadOptions& options);
+    void scheduleAsyncRead(std::shared_ptr<AsyncRead> asyncRead, const ReadOptions& options);
+    size_t getReadBytes(const FileRecord& fileRecord);
+    void prefetch(std::vector<FileRecord>& fileRecords, bool inflate);
+    void recordAccess(const std::string& filename);
+    void startPreload(std::shared_ptr<Preload> preload, const std::string& manifestFile, bool pin);
+    void runPreload(std::shared_ptr<Preload> preload, const std::string& manifestFile, bool pin);
+    void pinPreloadLoad(std::shared_ptr<Preload> preload, std::shared_ptr<PreloadLoad> load);
+    void finishPreloadLoad(std::shared_ptr<Preload> preload, std::shared_ptr<PreloadLoad> load, PreloadStatus status);
+    void runAsyncRead(std::shared_ptr<AsyncRead> asyncRead);
+    void inflateAsyncRead(std::shared_ptr<AsyncRead> asyncRead, std::shared_ptr<const char> rawData, size_t rawSize, bool shouldCache);
+    void finishAsyncRead(std::shared_ptr<AsyncRead> asyncRead, const ResourceBlob& blob, size_t bytesRead);
+    void failAsyncRead(std::shared_ptr<AsyncRead> asyncRead, std::exception_ptr exception);
+    bool shouldInflateAsync(const FileRecord& fileRecord);
+    
+    struct BatchEntry {
+        size_t index;                         // in the caller's list
+        FileRecord fileRecord;
+        std::string key;
+        bool shouldCache;
+    };
+    void readMany(std::vector<BatchEntry>& entries, std::vector<ResourceBlob>& blobs);
+    void readArchiveBatch(const std::string& archivePath, std::vector<BatchEntry*>& entries, std::vector<ResourceBlob>& blobs,
+                          std::vector<BatchEntry*>& unbatchedEntries, BatchLatch& latch);
     
     void checkZipFileOpened(StreamRecord* streamRecord);
     size_t readDataFromCompressedFile(const FileRecord& fileRecord, void* buffer, int size);
@@ -96,8 +367,12 @@ private:
     std::string makeKey(const std::string& filename);
     
     void rebuildIndex();
+    bool makeIndexKeys(FileRecord& fileRecord, std::vector<std::string>& keys);
+    void indexFileRecord(MountRecord& mountRecord, FileRecord& fileRecord);
+    void unindexFileRecord(MountRecord& mountRecord, FileRecord& fileRecord);
+    FileRecord* findShadowedFileRecord(const std::string& key, const MountRecord& removedMountRecord);
     FileRecord* findFileRecord(const std::string& filename);
-    StreamRecord* getStreamRecord(int handle);
+    std::shared_ptr<StreamRecord> getStreamRecord(int handle);
     
     void traceFileRecord(const std::string& key, const FileRecord& fileRecord);
 };
@@ -162,24 +437,454 @@ static std::string getRootFolder(const std::string& filePath) {
     return filePath.substr(0, firstSlash);
 }
 
-static long getFileSize(const std::string& filePath)
+// size and mtime of a regular file record
+static void statFile(const std::string& filePath, FileRecord& fileRecord)
 {
     struct stat stat_buf;
     int rc = stat(filePath.c_str(), &stat_buf);
-    return rc == 0 ? stat_buf.st_size : -1;
+    fileRecord.size = rc == 0 ? stat_buf.st_size : -1;
+#ifdef __APPLE__
+    fileRecord.modificationTime     = rc == 0 ? stat_buf.st_mtimespec.tv_sec : 0;
+    fileRecord.modificationTimeNsec = rc == 0 ? stat_buf.st_mtimespec.tv_nsec : 0;
+#else
+    fileRecord.modificationTime     = rc == 0 ? stat_buf.st_mtim.tv_sec : 0;
+    fileRecord.modificationTimeNsec = rc == 0 ? stat_buf.st_mtim.tv_nsec : 0;
+#endif
+}
+
+static bool statFolder(const std::string& folderPath, FolderRecord& folderRecord) {
+    struct stat stat_buf;
+    if (stat(folderPath.c_str(), &stat_buf) != 0 || !S_ISDIR(stat_buf.st_mode)) return false;
+    
+    folderRecord.device = stat_buf.st_dev;
+    folderRecord.inode  = stat_buf.st_ino;
+#ifdef __APPLE__
+    folderRecord.modificationTime     = stat_buf.st_mtimespec.tv_sec;
+    folderRecord.modificationTimeNsec = stat_buf.st_mtimespec.tv_nsec;
+#else
+    folderRecord.modificationTime     = stat_buf.st_mtim.tv_sec;
+    folderRecord.modificationTimeNsec = stat_buf.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+static bool isSameFolder(const FolderRecord& a, const FolderRecord& b) {
+    return a.device == b.device && a.inode == b.inode &&
+           a.modificationTime == b.modificationTime &&
+           a.modificationTimeNsec == b.modificationTimeNsec;
+}
+
+// reads folder entries sorted by name, skipping hidden and filtered out ones
+static bool readFolder(const std::string& folderPath, const std::string& relativeFolder, const MountFilter& filter,
+                       std::vector<std::string>& subfolders, std::vector<std::string>& filenames) {
+    DIR *dp = opendir(folderPath.c_str());
+    if (!dp) return false;
+    
+    bool shouldFilter = !filter.isEmpty();
+    
+    struct dirent *ep;
+    while ((ep = readdir(dp))) {
+        if (ep->d_name[0] == '.') continue;
+        
+        if (ep->d_type == DT_DIR) {
+            if (shouldFilter && !filter.matchesFolder(combine({relativeFolder, ep->d_name}))) continue;
+            subfolders.push_back(ep->d_name);
+        }
+        else {
+            if (shouldFilter && !filter.matchesFile(combine({relativeFolder, ep->d_name}))) continue;
+            filenames.push_back(ep->d_name);
+        }
+    }
+    
+    closedir(dp);
+    
+    std::sort(subfolders.begin(), subfolders.end());
+    std::sort(filenames.begin(), filenames.end());
+    return true;
 }
 
 //
-// ResourcesManager
+// zip central directory
 //
 
-ResourcesManager* ResourcesManager::sharedManager() {
-    static ResourcesManager* manager = nullptr;
+static uint16_t readLE16(const unsigned char* p) {
+    return uint16_t(p[0] | (p[1] << 8));
+}
+
+static uint32_t readLE32(const unsigned char* p) {
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static uint64_t readLE64(const unsigned char* p) {
+    return uint64_t(readLE32(p)) | (uint64_t(readLE32(p + 4)) << 32);
+}
+
+static bool preadFully(int fd, void* buffer, size_t size, uint64_t offset) {
+    char* out = static_cast<char*>(buffer);
+    while (size > 0) {
+        ssize_t bytesRead = pread(fd, out, size, offset);
+        if (bytesRead <= 0) return false;
+        
+        out += bytesRead;
+        size -= bytesRead;
+        offset += bytesRead;
+    }
+    return true;
+}
+
+struct CentralDirectory {
+    std::vector<unsigned char> data;
+    uint64_t offset = 0;            // as recorded in the archive, minizip's pos_in_zip_directory base
+    uint64_t entriesCount = 0;
+    uint64_t bytesBeforeArchive = 0; // self-extractor stub or other prefix
+    uint64_t archiveIdentity = 0;
+};
+
+// FNV-1a, stable across processes and runs
+static uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Locates the end of central directory record (and its zip64 variant) and
+// reads the central directory in one go.
+static bool readCentralDirectory(int fd, CentralDirectory& centralDirectory) {
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) return false;
+    uint64_t fileSize = stat_buf.st_size;
+    if (fileSize < 22) return false;
+    
+    uint64_t identity[4] = { uint64_t(stat_buf.st_dev), uint64_t(stat_buf.st_ino), fileSize, uint64_t(stat_buf.st_mtime) };
+    centralDirectory.archiveIdentity = hashBytes(identity, sizeof(identity));
+    
+    // the record is 22 bytes followed by a comment of up to 64k
+    uint64_t tailSize = std::min<uint64_t>(fileSize, 22 + 0xffff);
+    std::vector<unsigned char> tail(tailSize);
+    if (!preadFully(fd, tail.data(), tailSize, fileSize - tailSize)) return false;
+    
+    size_t endPos = std::string::npos;
+    for (size_t i = tailSize - 22 + 1; i-- > 0;) {
+        if (readLE32(&tail[i]) == 0x06054b50) {
+            endPos = i;
+            break;
+        }
+    }
+    if (endPos == std::string::npos) return false;
+    
+    uint64_t centralPos = fileSize - tailSize + endPos;
+    const unsigned char* end = &tail[endPos];
+    uint64_t entriesCount = readLE16(end + 10);
+    uint64_t size         = readLE32(end + 12);
+    uint64_t offset       = readLE32(end + 16);
+    if (readLE16(end + 8) != entriesCount) return false;
+    
+    if (entriesCount == 0xffff || size == 0xffffffff || offset == 0xffffffff) {
+        // zip64 locator precedes the end record
+        if (centralPos < 20) return false;
+        unsigned char locator[20];
+        if (!preadFully(fd, locator, sizeof(locator), centralPos - 20) || readLE32(locator) != 0x07064b50) return false;
+        
+        uint64_t zip64EndPos = readLE64(locator + 8);
+        unsigned char zip64End[56];
+        if (!preadFully(fd, zip64End, sizeof(zip64End), zip64EndPos) || readLE32(zip64End) != 0x06064b50) return false;
+        
+        entriesCount = readLE64(zip64End + 32);
+        size         = readLE64(zip64End + 40);
+        offset       = readLE64(zip64End + 48);
+        centralPos   = zip64EndPos;
+    }
+    
+    if (centralPos < offset + size) return false;
+    
+    centralDirectory.offset = offset;
+    centralDirectory.entriesCount = entriesCount;
+    centralDirectory.bytesBeforeArchive = centralPos - (offset + size);
+    centralDirectory.data.resize(size);
+    return size == 0 || preadFully(fd, centralDirectory.data.data(), size, centralDirectory.bytesBeforeArchive + offset);
+}
+
+// replaces 32 bit fields saturated at 0xffffffff with their zip64 values
+static void readZip64ExtraField(const unsigned char* extra, size_t extraSize,
+                                uint64_t& uncompressedSize, uint64_t& compressedSize, uint64_t& localHeaderOffset) {
+    if (uncompressedSize != 0xffffffff && compressedSize != 0xffffffff && localHeaderOffset != 0xffffffff) return;
+    
+    size_t pos = 0;
+    while (pos + 4 <= extraSize) {
+        uint16_t headerId = readLE16(extra + pos);
+        size_t dataSize = readLE16(extra + pos + 2);
+        if (pos + 4 + dataSize > extraSize) return;
+        
+        if (headerId == 0x0001) {
+            const unsigned char* field = extra + pos + 4;
+            const unsigned char* fieldEnd = field + dataSize;
+            
+            if (uncompressedSize == 0xffffffff && field + 8 <= fieldEnd) {
+                uncompressedSize = readLE64(field);
+                field += 8;
+            }
+            if (compressedSize == 0xffffffff && field + 8 <= fieldEnd) {
+                compressedSize = readLE64(field);
+                field += 8;
+            }
+            if (localHeaderOffset == 0xffffffff && field + 8 <= fieldEnd) {
+                localHeaderOffset = readLE64(field);
+            }
+            return;
+        }
+        
+        pos += 4 + dataSize;
+    }
+}
+
+//
+// scan state serialization
+//
+
+static const char scanStateMagic[] = "RMSS";
+static const uint32_t scanStateVersion = 3;
+
+static void writeUInt64(FILE* file, uint64_t value) {
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+static void writeString(FILE* file, const std::string& string) {
+    writeUInt64(file, string.size());
+    fwrite(string.data(), 1, string.size(), file);
+}
+
+static bool readUInt64(FILE* file, uint64_t& value) {
+    return fread(&value, sizeof(value), 1, file) == 1;
+}
+
+static bool readString(FILE* file, std::string& string) {
+    uint64_t size = 0;
+    if (!readUInt64(file, size) || size > 64 * 1024) return false;
+    
+    string.resize(size);
+    return size == 0 || fread(&string[0], 1, size, file) == size;
+}
+
+//
+// MountFilter
+//
+
+static std::string normalizeExtension(const std::string& extension) {
+    std::string normalized = (!extension.empty() && extension[0] == '.') ? extension.substr(1) : extension;
+    lowercase(normalized);
+    return normalized;
+}
+
+static bool hasWildcards(const std::string& string, size_t pos = 0) {
+    return string.find_first_of("*?", pos) != std::string::npos;
+}
+
+// '*' and '?' stop at '/', "**" does not
+static bool globMatch(const char* p, const char* pe, const char* s, const char* se) {
+    while (p < pe) {
+        if (*p == '*') {
+            bool crossesSlash = (p + 1 < pe && p[1] == '*');
+            p += crossesSlash ? 2 : 1;
+            
+            if (p == pe)
+                return crossesSlash || std::find(s, se, '/') == se;
+            
+            for (const char* t = s; t <= se; t++) {
+                if (globMatch(p, pe, t, se)) return true;
+                if (t < se && *t == '/' && !crossesSlash) return false;
+            }
+            return false;
+        }
+        
+        if (s == se) return false;
+        if (*p == '?') {
+            if (*s == '/') return false;
+        }
+        else if (*p != *s) {
+            return false;
+        }
+        p++;
+        s++;
+    }
+    
+    return s == se;
+}
+
+MountFilter::Pattern MountFilter::compilePattern(const std::string& patternString) {
+    Pattern pattern;
+    pattern.source = patternString;
+    pattern.text = patternString;
+    lowercase(pattern.text);
+    std::replace(pattern.text.begin(), pattern.text.end(), '\\', '/');
+    
+    const std::string& text = pattern.text;
+    size_t size = text.size();
+    
+    if (!hasWildcards(text)) {
+        pattern.kind = LiteralPattern;
+    }
+    else if (size > 1 && text[0] == '*' && text[1] != '*' && !hasWildcards(text, 1) && text.find('/') == std::string::npos) {
+        pattern.kind = SuffixPattern;               // *.psd
+        pattern.text = text.substr(1);
+    }
+    else if (size > 3 && text.compare(size - 3, 3, "/**") == 0 && !hasWildcards(text.substr(0, size - 3))) {
+        pattern.kind = PrefixPattern;               // editor/**
+        pattern.text = text.substr(0, size - 2);
+    }
+    else {
+        pattern.kind = GlobPattern;
+    }
+    
+    return pattern;
+}
+
+bool MountFilter::matchesPattern(const Pattern& pattern, const char* begin, const char* end) {
+    size_t size = end - begin;
+    const std::string& text = pattern.text;
+    
+    switch (pattern.kind) {
+        case LiteralPattern:
+            return size == text.size() && text.compare(0, size, begin, size) == 0;
+        case SuffixPattern:
+            return size >= text.size() && text.compare(0, text.size(), end - text.size(), text.size()) == 0;
+        case PrefixPattern:
+            // matches the folder itself as well as everything below it
+            return (size >= text.size() && text.compare(0, text.size(), begin, text.size()) == 0) ||
+                   (size + 1 == text.size() && text.compare(0, size, begin, size) == 0);
+        case GlobPattern:
+            return globMatch(text.data(), text.data() + text.size(), begin, end);
+    }
+    
+    return false;
+}
+
+bool MountFilter::matchesAny(const std::vector<Pattern>& patterns, const char* begin, const char* end) {
+    for (auto& pattern : patterns) {
+        if (matchesPattern(pattern, begin, end)) return true;
+    }
+    return false;
+}
+
+MountFilter& MountFilter::include(const std::string& pattern) {
+    Pattern compiledPattern = compilePattern(pattern);
+    if (compiledPattern.text.find('/') == std::string::npos)
+        includeNamePatterns.push_back(compiledPattern);
+    else
+        includePathPatterns.push_back(compiledPattern);
+    return *this;
+}
+
+MountFilter& MountFilter::exclude(const std::string& pattern) {
+    Pattern compiledPattern = compilePattern(pattern);
+    if (compiledPattern.text.find('/') == std::string::npos)
+        excludeNamePatterns.push_back(compiledPattern);
+    else
+        excludePathPatterns.push_back(compiledPattern);
+    return *this;
+}
+
+MountFilter& MountFilter::includeExtension(const std::string& extension) {
+    includeExtensions.insert(normalizeExtension(extension));
+    return *this;
+}
+
+MountFilter& MountFilter::excludeExtension(const std::string& extension) {
+    excludeExtensions.insert(normalizeExtension(extension));
+    return *this;
+}
+
+bool MountFilter::isEmpty() const {
+    return includeNamePatterns.empty() && includePathPatterns.empty() &&
+           excludeNamePatterns.empty() && excludePathPatterns.empty() &&
+           includeExtensions.empty() && excludeExtensions.empty();
+}
+
+// checks the folder whose path ends at folderEnd, not its parents
+bool MountFilter::isExcludedFolder(const std::string& lowercasePath, size_t folderEnd) const {
+    const char* begin = lowercasePath.data();
+    size_t nameBegin = lowercasePath.rfind('/', folderEnd == 0 ? 0 : folderEnd - 1);
+    nameBegin = (nameBegin == std::string::npos || nameBegin >= folderEnd) ? 0 : nameBegin + 1;
+    
+    return matchesAny(excludeNamePatterns, begin + nameBegin, begin + folderEnd) ||
+           matchesAny(excludePathPatterns, begin, begin + folderEnd);
+}
+
+bool MountFilter::matchesLowercaseFile(const std::string& lowercasePath) const {
+    const char* begin = lowercasePath.data();
+    const char* end = begin + lowercasePath.size();
+    
+    size_t slash = lowercasePath.find_last_of('/');
+    const char* name = (slash == std::string::npos) ? begin : begin + slash + 1;
+    
+    const char* dot = end;
+    while (dot > name && *(dot - 1) != '.') dot--;
+    std::string extension = (dot > name) ? std::string(dot, end) : std::string();
+    
+    if (!excludeExtensions.empty() && excludeExtensions.count(extension)) return false;
+    if (matchesAny(excludeNamePatterns, name, end)) return false;
+    if (matchesAny(excludePathPatterns, begin, end)) return false;
+    
+    if (includeExtensions.empty() && includeNamePatterns.empty() && includePathPatterns.empty())
+        return true;
+    
+    return includeExtensions.count(extension) ||
+           matchesAny(includeNamePatterns, name, end) ||
+           matchesAny(includePathPatterns, begin, end);
+}
+
+bool MountFilter::matchesFolder(const std::string& relativeFolder) const {
+    if (excludeNamePatterns.empty() && excludePathPatterns.empty()) return true;
+    
+    std::string lowercasePath = relativeFolder;
+    lowercase(lowercasePath);
+    return !isExcludedFolder(lowercasePath, lowercasePath.size());
+}
+
+bool MountFilter::matchesFile(const std::string& relativePath) const {
+    if (isEmpty()) return true;
+    
+    std::string lowercasePath = relativePath;
+    lowercase(lowercasePath);
+    return matchesLowercaseFile(lowercasePath);
+}
+
+bool MountFilter::matchesEntry(const std::string& relativePath) const {
+    if (isEmpty()) return true;
+    
+    std::string lowercasePath = relativePath;
+    lowercase(lowercasePath);
     
-    if (!manager) {
-        manager = new ResourcesManager();
+    if (!excludeNamePatterns.empty() || !excludePathPatterns.empty()) {
+        for (size_t slash = lowercasePath.find('/'); slash != std::string::npos; slash = lowercasePath.find('/', slash + 1)) {
+            if (isExcludedFolder(lowercasePath, slash)) return false;
+        }
     }
     
+    return matchesLowercaseFile(lowercasePath);
+}
+
+std::string MountFilter::getSignature() const {
+    std::stringstream out;
+    for (auto& pattern : includeNamePatterns) out << "+" << pattern.source << "\n";
+    for (auto& pattern : includePathPatterns) out << "+" << pattern.source << "\n";
+    for (auto& pattern : excludeNamePatterns) out << "-" << pattern.source << "\n";
+    for (auto& pattern : excludePathPatterns) out << "-" << pattern.source << "\n";
+    for (auto& extension : includeExtensions) out << "+." << extension << "\n";
+    for (auto& extension : excludeExtensions) out << "-." << extension << "\n";
+    return out.str();
+}
+
+//
+// ResourcesManager
+//
+
+// the first call may come from any thread, static initialization is thread safe
+ResourcesManager* ResourcesManager::sharedManager() {
+    static ResourcesManager* manager = new ResourcesManager();
+    
     return manager;
 }
 
@@ -193,11 +898,18 @@ ResourcesManager::ResourcesManager() :
 // configuration methods
 //
 
+// Mounts started after the wait are dropped with their records, their scans find
+// no record to commit to.
 void ResourcesManager::reset() {
+    pImpl->waitForAllMounts();
+    
+    std::shared_ptr<ThreadPool> oldInflateThreadPool;   // joined after the lock is released, see setInflateThreads
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    
     pImpl->enableTrace = false;
-    pImpl->shouldRebuildIndex = false;
-    pImpl->rootFoldersList.clear();
-    pImpl->fileRecordList.clear();
+    pImpl->shouldRebuildIndex = true;
+    pImpl->mountsList.clear();
+    pImpl->pendingMountsCount = 0;
     pImpl->fileRecordIndex.clear();
     pImpl->languageId.clear();
     pImpl->relativeFolderToLanguageIdMap.clear();
@@ -205,46 +917,195 @@ void ResourcesManager::reset() {
     pImpl->enabledCategories.clear();
     pImpl->searchByRelativePaths = false;
     pImpl->searchRootsList = {""};
+    pImpl->archiveMappings.clear();
+    pImpl->sharedBlobs.clear();
+    pImpl->pinnedFiles.clear();
+    pImpl->pinnedSize = 0;
+    pImpl->pinnedBudget = 32 * 1024 * 1024;
+    pImpl->fileDescriptorCache.clear();
+    pImpl->fileDescriptorCache.setMaxOpenFiles(ResourcesManagerImpl::defaultMaxOpenFiles);
+    pImpl->contentCacheOptions = ContentCacheOptions();
+    pImpl->contentCache.setPolicy(nullptr);
+    pImpl->contentCache.setCapacity(pImpl->contentCacheOptions.capacity);
+    pImpl->contentCache.resetStats();
+    pImpl->compressedCache.clear();
+    pImpl->compressedCache.setCapacity(pImpl->contentCacheOptions.compressedCapacity);
+    pImpl->compressedCache.resetStats();
+    pImpl->diskCache.setFolder("", 0);
+    pImpl->sharedMemoryCache.close();
+    pImpl->mapAdvice = MapAdviceNormal;
+    pImpl->minimumMappedSize = 64 * 1024;
+    std::atomic_store(&pImpl->accessPredictor, std::shared_ptr<AccessPredictor>());
+    pImpl->accessPredictorFile.clear();
+    pImpl->accessPredictorInflates = false;
+    if (pImpl->inflateThreadsCount || !pImpl->inflateThreadsCpus.empty()) {
+        pImpl->inflateThreadsCount = 0;
+        pImpl->inflateThreadsCpus.clear();
+        oldInflateThreadPool.swap(pImpl->inflateThreadPool);
+    }
+}
+
+void ResourcesManager::setMaxOpenFiles(size_t maxOpenFiles) {
+    pImpl->fileDescriptorCache.setMaxOpenFiles(maxOpenFiles);
+}
+
+void ResourcesManager::setContentCacheOptions(const ContentCacheOptions& options) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    
+    // entries outside the new admission rules are dropped
+    if (options.compressedOnly != pImpl->contentCacheOptions.compressedOnly ||
+        options.minimumSize != pImpl->contentCacheOptions.minimumSize ||
+        options.maximumSize != pImpl->contentCacheOptions.maximumSize)
+        pImpl->contentCache.clear();
+    
+    pImpl->contentCacheOptions = options;
+    pImpl->contentCache.setCapacity(options.capacity);
+    pImpl->compressedCache.clear();
+    pImpl->compressedCache.setCapacity(options.compressedCapacity);
+}
+
+void ResourcesManager::setContentCachePolicy(std::unique_ptr<ContentCachePolicy> policy) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    pImpl->contentCache.setPolicy(std::move(policy));
+}
+
+ContentCacheStats ResourcesManager::getContentCacheStats() {
+    return pImpl->contentCache.getStats();
+}
+
+ContentCacheStats ResourcesManager::getCompressedCacheStats() {
+    return pImpl->compressedCache.getStats();
+}
+
+void ResourcesManager::setDiskCache(const std::string& folder, size_t budget, size_t minimumSize /* = 64 * 1024 */) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    
+    pImpl->diskCache.setFolder(folder, budget);
+    pImpl->diskCacheMinimumSize = minimumSize;
+}
+
+ContentCacheStats ResourcesManager::getDiskCacheStats() {
+    return pImpl->diskCache.getStats();
+}
+
+bool ResourcesManager::setSharedMemoryCache(const std::string& name, size_t capacity, size_t maxEntriesCount /* = 4096 */) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    return pImpl->sharedMemoryCache.open(name, capacity, maxEntriesCount);
+}
+
+ContentCacheStats ResourcesManager::getSharedMemoryCacheStats() {
+    return pImpl->sharedMemoryCache.getStats();
+}
+
+void ResourcesManager::setMapAdvice(MapAdvice mapAdvice) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    pImpl->mapAdvice = mapAdvice;
+}
+
+void ResourcesManager::setMinimumMappedSize(size_t minimumMappedSize) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    pImpl->minimumMappedSize = minimumMappedSize;
 }
 
 void ResourcesManager::enableTrace(bool enableTrace) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
     pImpl->enableTrace = enableTrace;
 }
 
 void ResourcesManager::addRootFolder(const std::string& rootFolder) {
-    pImpl->rootFoldersList.push_back(rootFolder);
-    pImpl->addFolderRecursive(rootFolder, "");
+    pImpl->mount(rootFolder, "", "", MountFilter(), "", nullptr, false).get();
+}
+
+void ResourcesManager::addRootFolder(const std::string& rootFolder, const MountFilter& filter) {
+    pImpl->mount(rootFolder, "", "", filter, "", nullptr, false).get();
+}
+
+void ResourcesManager::addRootFolder(const std::string& rootFolder, const std::string& scanStateFile, const MountFilter& filter /* = MountFilter() */) {
+    pImpl->mount(rootFolder, "", "", filter, scanStateFile, nullptr, false).get();
+}
+
+std::shared_future<void> ResourcesManager::addRootFolderAsync(const std::string& rootFolder, std::shared_ptr<MountProgress> progress /* = nullptr */,
+                                                              const MountFilter& filter /* = MountFilter() */) {
+    return pImpl->mount(rootFolder, "", "", filter, "", progress, true);
+}
+
+void ResourcesManager::rescanRootFolder(const std::string& rootFolder) {
+    pImpl->waitForPendingMounts(rootFolder, "");
+    
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    
+    MountRecord* mountRecord = pImpl->findMountRecord(rootFolder);
+    if (!mountRecord) return;
+    
+    pImpl->rescanFolderRecursive(*mountRecord, "");
+}
+
+bool ResourcesManager::saveRootFolderScanState(const std::string& rootFolder, const std::string& scanStateFile) {
+    pImpl->waitForPendingMounts(rootFolder, "");
+    
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    
+    MountRecord* mountRecord = pImpl->findMountRecord(rootFolder);
+    if (!mountRecord) return false;
+    
+    return pImpl->saveScanState(*mountRecord, scanStateFile);
+}
+
+void ResourcesManager::removeRootFolder(const std::string& rootFolder) {
+    pImpl->waitForPendingMounts(rootFolder, "");
+    
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    pImpl->removeMounts(rootFolder, "");
+}
+
+void ResourcesManager::removeArchive(const std::string& archivePath) {
+    pImpl->waitForPendingMounts("", archivePath);
+    
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    pImpl->removeMounts("", archivePath);
 }
 
 void ResourcesManager::addLanguageFolder(const std::string& languageId, const std::string& languageFolder) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+
     pImpl->relativeFolderToLanguageIdMap[languageFolder] = languageId;
     
     pImpl->shouldRebuildIndex = true;
 }
 
 void ResourcesManager::setCurrentLanguage(const std::string& languageId) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+
     pImpl->languageId = languageId;
     
     pImpl->shouldRebuildIndex = true;
 }
 
 void ResourcesManager::addCategoryFolder(const std::string& category, const std::string& categoryFolder) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+
     pImpl->relativeFolderToCategoryMap[categoryFolder] = category;
     
     pImpl->shouldRebuildIndex = true;
 }
 void ResourcesManager::enableCategory(const std::string& category){
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+
     pImpl->enabledCategories.insert(category);
 
     pImpl->shouldRebuildIndex = true;
 }
 void ResourcesManager::disableCategory(const std::string& category) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+
     pImpl->enabledCategories.erase(category);
 
     pImpl->shouldRebuildIndex = true;
 }
 
 void ResourcesManager::setSearchByRelativePaths(bool searchByRelativePaths) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+
     if (searchByRelativePaths != pImpl->searchByRelativePaths) {
         pImpl->searchByRelativePaths = searchByRelativePaths;
 
@@ -253,6 +1114,8 @@ void ResourcesManager::setSearchByRelativePaths(bool searchByRelativePaths) {
 }
 
 void ResourcesManager::addSearchRoot(const std::string& searchRoot) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+
     std::string canonicalSearchRoot = searchRoot;
     replaceAll(canonicalSearchRoot, "\\\\", "/");
     pImpl->searchRootsList.push_back(canonicalSearchRoot);
@@ -265,384 +1128,2648 @@ void ResourcesManager::addSearchRoot(const std::string& searchRoot) {
 // filesystem methods
 //
 
-void ResourcesManagerImpl::addFolderRecursive(const std::string& rootFolder, const std::string& relativeFolder) {
+//
+// mounting
+//
+
+// Reserves the mount's position in the shadowing order up front, so the result
+// does not depend on the order in which asynchronous scans complete.
+std::shared_future<void> ResourcesManagerImpl::mount(const std::string& rootFolder, const std::string& archivePath, const std::string& archiveRootFolder,
+                                                     const MountFilter& filter, const std::string& scanStateFile,
+                                                     const std::shared_ptr<MountProgress>& progress, bool async) {
+    auto promise = std::make_shared<std::promise<void>>();
+    
+    // the scan gets its own copy of the parameters, the listed record is only touched under the lock
+    auto scannedMountRecord = std::make_shared<MountRecord>();
+    scannedMountRecord->rootFolder        = rootFolder;
+    scannedMountRecord->archivePath       = archivePath;
+    scannedMountRecord->archiveRootFolder = archiveRootFolder;
+    scannedMountRecord->filter            = filter;
+    scannedMountRecord->progress          = progress;
+    
+    std::shared_future<void> future = promise->get_future().share();
+    
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        
+        scannedMountRecord->mountId = ++lastMountId;
+        
+        mountsList.push_back(MountRecord());
+        MountRecord& mountRecord = mountsList.back();
+        mountRecord.mountId           = scannedMountRecord->mountId;
+        mountRecord.rootFolder        = rootFolder;
+        mountRecord.archivePath       = archivePath;
+        mountRecord.archiveRootFolder = archiveRootFolder;
+        mountRecord.filter            = filter;
+        mountRecord.progress          = progress;
+        mountRecord.pending           = true;
+        mountRecord.future            = future;
+        pendingMountsCount++;
+        
+        if (async && !mountThreadPool)
+            mountThreadPool.reset(new ThreadPool(ThreadPool::getDefaultThreadsCount()));
+    }
     
-    DIR *dp = opendir(combine({rootFolder, relativeFolder}).c_str());
-    if (!dp) return;
+    if (async)
+        mountThreadPool->enqueue(std::bind(&ResourcesManagerImpl::runMount, this, scannedMountRecord, scanStateFile, promise));
+    else
+        runMount(scannedMountRecord, scanStateFile, promise);
     
-    struct dirent *ep;
-    while ((ep = readdir(dp))) {
-        if (ep->d_name[0] == '.') continue;
-        
-        if (ep->d_type == DT_DIR) {
-            std::string newRelativeFolder = combine({relativeFolder, ep->d_name});
-            addFolderRecursive(rootFolder, newRelativeFolder);
-        } else {
-            FileRecord fileRecord;
-            fileRecord.filename    = ep->d_name;
-            fileRecord.fileType    = RegularFile;
-            fileRecord.relativePath= combine({relativeFolder, ep->d_name});
-            fileRecord.filePath    = combine({rootFolder, fileRecord.relativePath});
-            fileRecord.size        = getFileSize(fileRecord.filePath);
-            
-            fileRecordList.push_back(fileRecord);
+    return future;
+}
 
-            shouldRebuildIndex = true;
+// Scans without holding the lock into a detached record, then commits it.
+void ResourcesManagerImpl::runMount(std::shared_ptr<MountRecord> scannedMountRecord, const std::string& scanStateFile, std::shared_ptr<std::promise<void>> promise) {
+    try {
+        if (!scannedMountRecord->archivePath.empty())
+            scanArchive(*scannedMountRecord);
+        else if (!scanStateFile.empty() && loadScanState(*scannedMountRecord, scanStateFile))
+            rescanFolderRecursive(*scannedMountRecord, "");
+        else
+            addFolderRecursive(*scannedMountRecord, "");
+    }
+    catch (...) {
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            
+            for (auto it = mountsList.begin(); it != mountsList.end(); ++it) {
+                if (it->mountId == scannedMountRecord->mountId) {
+                    pendingMountsCount--;
+                    mountsList.erase(it);
+                    break;
+                }
+            }
         }
+        
+        promise->set_exception(std::current_exception());
+        return;
     }
     
-    closedir(dp);
+    commitMount(*scannedMountRecord);
+    promise->set_value();
 }
 
-size_t ResourcesManagerImpl::readDataFromRegularFile(const std::string& filePath, void* buffer, int size) {
-    FILE* file = fopen(filePath.c_str(), "rb");
-    if (!file) return 0;
-    
-    size_t bytesRead = fread(buffer, 1, size, file);
-    
-    fclose(file);
-    
-    return bytesRead;
+// The listed record is found by id, the scan is dropped if the record is gone.
+void ResourcesManagerImpl::commitMount(MountRecord& scannedMountRecord) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    auto it = std::find_if(mountsList.begin(), mountsList.end(), [&scannedMountRecord](const MountRecord& mountRecord) {
+        return mountRecord.mountId == scannedMountRecord.mountId;
+    });
+    if (it == mountsList.end()) return;
+    MountRecord& mountRecord = *it;
+    
+    // splicing keeps the iterators held by folder records valid
+    mountRecord.fileRecords.splice(mountRecord.fileRecords.end(), scannedMountRecord.fileRecords);
+    mountRecord.folders.swap(scannedMountRecord.folders);
+    mountRecord.mounted = true;
+    mountRecord.pending = false;
+    pendingMountsCount--;
+    
+    if (!shouldRebuildIndex) {
+        for (auto& fileRecord : mountRecord.fileRecords) {
+            indexFileRecord(mountRecord, fileRecord);
+        }
+    }
 }
 
-//
-// zip archive methods
-//
-
-unzFile ResourcesManagerImpl::openSharedZip(const std::string& archivePath) {
-    auto it = sharedZipFiles.find(archivePath);
+// Waits for the pending mounts that could change the lookup result of filename:
+// those mounted after the record found so far, or all of them if nothing is found.
+void ResourcesManagerImpl::waitForMounts(const std::string& filename) {
+    for (;;) {
+        std::vector<std::shared_future<void>> dependencies;
+        
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            if (pendingMountsCount == 0) return;
+            
+            FileRecord* fileRecord = findFileRecord(filename);
+            unsigned mountId = fileRecord ? fileRecord->mountId : 0;
+            
+            for (auto& mountRecord : mountsList) {
+                if (mountRecord.pending && mountRecord.mountId > mountId)
+                    dependencies.push_back(mountRecord.future);
+            }
+        }
+        
+        if (dependencies.empty()) return;
+        
+        for (auto& future : dependencies) {
+            future.wait();
+        }
+    }
+}
+
+void ResourcesManagerImpl::waitForAllMounts() {
+    std::vector<std::shared_future<void>> dependencies = getPendingMounts();
+    
+    for (auto& future : dependencies) {
+        future.wait();
+    }
+}
+
+std::vector<std::shared_future<void>> ResourcesManagerImpl::getPendingMounts() {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    std::vector<std::shared_future<void>> dependencies;
+    for (auto& mountRecord : mountsList) {
+        if (mountRecord.pending)
+            dependencies.push_back(mountRecord.future);
+    }
+    return dependencies;
+}
+
+void ResourcesManagerImpl::waitForPendingMounts(const std::string& rootFolder, const std::string& archivePath) {
+    std::vector<std::shared_future<void>> dependencies;
+    
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        for (auto& mountRecord : mountsList) {
+            if (mountRecord.pending && mountRecord.rootFolder == rootFolder && mountRecord.archivePath == archivePath)
+                dependencies.push_back(mountRecord.future);
+        }
+    }
+    
+    for (auto& future : dependencies) {
+        future.wait();
+    }
+}
+
+// Cached and pinned contents are dropped record by record: a key prefix of a root
+// folder would reach into the records of a root mounted below it.
+void ResourcesManagerImpl::removeMounts(const std::string& rootFolder, const std::string& archivePath) {
+    std::vector<std::string> pinnedKeys;
+    for (auto it = mountsList.begin(); it != mountsList.end();) {
+        auto mountRecordIt = it++;
+        if (!mountRecordIt->mounted || mountRecordIt->rootFolder != rootFolder || mountRecordIt->archivePath != archivePath) continue;
+        
+        for (auto& fileRecord : mountRecordIt->fileRecords) {
+            invalidateCachedFile(fileRecord);
+            if (fileRecord.pinnedContents)
+                pinnedKeys.push_back(makeContentKey(fileRecord));
+        }
+        removeMount(mountRecordIt);
+    }
+    
+    if (!archivePath.empty())
+        closeSharedZip(archivePath);
+    
+    for (auto& key : pinnedKeys) {
+        releasePinnedFile(key);
+    }
+}
+
+// Costs O(mount size): only keys of the mount's own shard are revisited, and a key
+// it won is handed back to the latest other mount that has it.
+void ResourcesManagerImpl::removeMount(std::list<MountRecord>::iterator mountRecordIt) {
+    if (!shouldRebuildIndex) {
+        for (auto& keyFileRecordPair : mountRecordIt->index) {
+            auto it = fileRecordIndex.find(keyFileRecordPair.first);
+            if (it == fileRecordIndex.end() || it->second != keyFileRecordPair.second) continue;
+            
+            FileRecord* shadowedFileRecord = findShadowedFileRecord(keyFileRecordPair.first, *mountRecordIt);
+            if (shadowedFileRecord)
+                it->second = shadowedFileRecord;
+            else
+                fileRecordIndex.erase(it);
+        }
+    }
+    
+    mountsList.erase(mountRecordIt);
+}
+
+//
+// filesystem methods
+//
+
+MountRecord* ResourcesManagerImpl::findMountRecord(const std::string& rootFolder) {
+    for (auto& mountRecord : mountsList) {
+        if (mountRecord.archivePath.empty() && mountRecord.rootFolder == rootFolder)
+            return &mountRecord;
+    }
+    
+    return nullptr;
+}
+
+FileRecordList::iterator ResourcesManagerImpl::addRegularFileRecord(MountRecord& mountRecord, const std::string& relativeFolder, const std::string& filename) {
+    FileRecord fileRecord;
+    fileRecord.filename    = filename;
+    fileRecord.fileType    = RegularFile;
+    fileRecord.relativePath= combine({relativeFolder, filename});
+    fileRecord.filePath    = combine({mountRecord.rootFolder, fileRecord.relativePath});
+    fileRecord.mountId     = mountRecord.mountId;
+    statFile(fileRecord.filePath, fileRecord);
+    
+    auto fileRecordIt = mountRecord.fileRecords.insert(mountRecord.fileRecords.end(), fileRecord);
+    
+    if (mountRecord.progress)
+        mountRecord.progress->entriesFound++;
+    
+    // records are appended to their mount, so patching the index gives the same result as a rebuild
+    if (mountRecord.mounted && !shouldRebuildIndex)
+        indexFileRecord(mountRecord, *fileRecordIt);
+    
+    return fileRecordIt;
+}
+
+void ResourcesManagerImpl::removeFileRecord(MountRecord& mountRecord, FileRecordList::iterator fileRecordIt) {
+    invalidateCachedFile(*fileRecordIt);
+    std::string pinnedKey = fileRecordIt->pinnedContents ? makeContentKey(*fileRecordIt) : "";
+    
+    if (mountRecord.mounted && !shouldRebuildIndex)
+        unindexFileRecord(mountRecord, *fileRecordIt);
+    
+    mountRecord.fileRecords.erase(fileRecordIt);
+    
+    if (!pinnedKey.empty())
+        releasePinnedFile(pinnedKey);
+}
+
+void ResourcesManagerImpl::addFolderRecursive(MountRecord& mountRecord, const std::string& relativeFolder) {
+    std::string folderPath = combine({mountRecord.rootFolder, relativeFolder});
+    
+    FolderRecord folderRecord;
+    if (!statFolder(folderPath, folderRecord)) return;
+    
+    std::vector<std::string> filenames;
+    if (!readFolder(folderPath, relativeFolder, mountRecord.filter, folderRecord.subfolders, filenames)) return;
+    
+    for (auto& filename : filenames) {
+        folderRecord.fileRecords.push_back(addRegularFileRecord(mountRecord, relativeFolder, filename));
+    }
+    
+    mountRecord.folders[relativeFolder] = folderRecord;
+    
+    for (auto& subfolder : folderRecord.subfolders) {
+        addFolderRecursive(mountRecord, combine({relativeFolder, subfolder}));
+    }
+}
+
+// Cached and pinned contents are dropped when the size or mtime changed, or always when forced.
+void ResourcesManagerImpl::refreshFileRecord(FileRecord& fileRecord, bool force /* = false */) {
+    FileRecord currentFileRecord;
+    statFile(fileRecord.filePath, currentFileRecord);
+    
+    if (!force && currentFileRecord.size == fileRecord.size &&
+        currentFileRecord.modificationTime == fileRecord.modificationTime &&
+        currentFileRecord.modificationTimeNsec == fileRecord.modificationTimeNsec) return;
+    
+    invalidateCachedFile(fileRecord);
+    fileRecord.size                 = currentFileRecord.size;
+    fileRecord.modificationTime     = currentFileRecord.modificationTime;
+    fileRecord.modificationTimeNsec = currentFileRecord.modificationTimeNsec;
+    if (fileRecord.pinnedContents)
+        reloadPinnedFile(fileRecord);
+}
+
+void ResourcesManagerImpl::removeFolderRecursive(MountRecord& mountRecord, const std::string& relativeFolder) {
+    auto it = mountRecord.folders.find(relativeFolder);
+    if (it == mountRecord.folders.end()) return;
+    
+    for (auto fileRecordIt : it->second.fileRecords) {
+        removeFileRecord(mountRecord, fileRecordIt);
+    }
+    
+    std::vector<std::string> subfolders;
+    subfolders.swap(it->second.subfolders);
+    mountRecord.folders.erase(it);
+    
+    for (auto& subfolder : subfolders) {
+        removeFolderRecursive(mountRecord, combine({relativeFolder, subfolder}));
+    }
+}
+
+// Folders whose device, inode and mtime match the last scan are not enumerated again,
+// only their known files are stat'ed and their known subfolders visited. A folder mtime
+// changes on adding, removing or renaming entries, not on rewriting a file in place.
+void ResourcesManagerImpl::rescanFolderRecursive(MountRecord& mountRecord, const std::string& relativeFolder) {
+    auto it = mountRecord.folders.find(relativeFolder);
+    if (it == mountRecord.folders.end()) {
+        addFolderRecursive(mountRecord, relativeFolder);
+        return;
+    }
+    
+    std::string folderPath = combine({mountRecord.rootFolder, relativeFolder});
+    
+    FolderRecord currentFolderRecord;
+    if (!statFolder(folderPath, currentFolderRecord)) {
+        removeFolderRecursive(mountRecord, relativeFolder);
+        return;
+    }
+    
+    FolderRecord& folderRecord = it->second;
+    
+    if (isSameFolder(folderRecord, currentFolderRecord)) {
+        for (auto fileRecordIt : folderRecord.fileRecords) {
+            refreshFileRecord(*fileRecordIt);
+        }
+        for (auto& subfolder : folderRecord.subfolders) {
+            rescanFolderRecursive(mountRecord, combine({relativeFolder, subfolder}));
+        }
+        return;
+    }
+    
+    std::vector<std::string> filenames;
+    if (!readFolder(folderPath, relativeFolder, mountRecord.filter, currentFolderRecord.subfolders, filenames)) {
+        removeFolderRecursive(mountRecord, relativeFolder);
+        return;
+    }
+    
+    // merge sorted file lists: keep, add or remove records
+    auto oldIt = folderRecord.fileRecords.begin();
+    auto newIt = filenames.begin();
+    while (oldIt != folderRecord.fileRecords.end() || newIt != filenames.end()) {
+        if (newIt == filenames.end() ||
+            (oldIt != folderRecord.fileRecords.end() && (*oldIt)->filename < *newIt)) {
+            removeFileRecord(mountRecord, *oldIt);
+            ++oldIt;
+        }
+        else if (oldIt == folderRecord.fileRecords.end() || *newIt < (*oldIt)->filename) {
+            currentFolderRecord.fileRecords.push_back(addRegularFileRecord(mountRecord, relativeFolder, *newIt));
+            ++newIt;
+        }
+        else {
+            // the file may have been replaced by a rename
+            refreshFileRecord(**oldIt, true);
+            currentFolderRecord.fileRecords.push_back(*oldIt);
+            ++oldIt;
+            ++newIt;
+        }
+    }
+    
+    std::vector<std::string> removedSubfolders;
+    std::set_difference(folderRecord.subfolders.begin(), folderRecord.subfolders.end(),
+                        currentFolderRecord.subfolders.begin(), currentFolderRecord.subfolders.end(),
+                        std::back_inserter(removedSubfolders));
+    
+    folderRecord = currentFolderRecord;
+    
+    for (auto& subfolder : removedSubfolders) {
+        removeFolderRecursive(mountRecord, combine({relativeFolder, subfolder}));
+    }
+    
+    for (auto& subfolder : currentFolderRecord.subfolders) {
+        rescanFolderRecursive(mountRecord, combine({relativeFolder, subfolder}));
+    }
+}
+
+bool ResourcesManagerImpl::saveScanState(const MountRecord& mountRecord, const std::string& scanStateFile) {
+    std::string tempFile = scanStateFile + ".tmp";
+    FILE* file = fopen(tempFile.c_str(), "wb");
+    if (!file) return false;
+    
+    fwrite(scanStateMagic, 1, 4, file);
+    writeUInt64(file, scanStateVersion);
+    writeString(file, mountRecord.rootFolder);
+    writeString(file, mountRecord.filter.getSignature());
+    writeUInt64(file, mountRecord.folders.size());
+    
+    for (auto& folderPair : mountRecord.folders) {
+        const FolderRecord& folderRecord = folderPair.second;
+        
+        writeString(file, folderPair.first);
+        writeUInt64(file, folderRecord.device);
+        writeUInt64(file, folderRecord.inode);
+        writeUInt64(file, folderRecord.modificationTime);
+        writeUInt64(file, folderRecord.modificationTimeNsec);
+        
+        writeUInt64(file, folderRecord.subfolders.size());
+        for (auto& subfolder : folderRecord.subfolders)
+            writeString(file, subfolder);
+        
+        writeUInt64(file, folderRecord.fileRecords.size());
+        for (auto fileRecordIt : folderRecord.fileRecords) {
+            writeString(file, fileRecordIt->filename);
+            writeUInt64(file, fileRecordIt->size);
+            writeUInt64(file, fileRecordIt->modificationTime);
+            writeUInt64(file, fileRecordIt->modificationTimeNsec);
+        }
+    }
+    
+    bool succeeded = !ferror(file);
+    succeeded = (fclose(file) == 0) && succeeded;
+    
+    // replace atomically so a crash never leaves a truncated state behind
+    if (!succeeded || rename(tempFile.c_str(), scanStateFile.c_str()) != 0) {
+        unlink(tempFile.c_str());
+        return false;
+    }
+    
+    return true;
+}
+
+bool ResourcesManagerImpl::loadScanState(MountRecord& mountRecord, const std::string& scanStateFile) {
+    FILE* file = fopen(scanStateFile.c_str(), "rb");
+    if (!file) return false;
+    
+    std::map<std::string, FolderRecord> folders;
+    std::vector<FileRecord> fileRecords;
+    std::vector<std::pair<std::string, size_t>> folderFileCounts;
+    
+    bool succeeded = false;
+    do {
+        char magic[4];
+        uint64_t version = 0, folderCount = 0;
+        std::string rootFolder, filterSignature;
+        if (fread(magic, 1, 4, file) != 4 || memcmp(magic, scanStateMagic, 4) != 0) break;
+        if (!readUInt64(file, version) || version != scanStateVersion) break;
+        if (!readString(file, rootFolder) || rootFolder != mountRecord.rootFolder) break;
+        if (!readString(file, filterSignature) || filterSignature != mountRecord.filter.getSignature()) break;
+        if (!readUInt64(file, folderCount)) break;
+        
+        bool folderFailed = false;
+        for (uint64_t i = 0; i < folderCount && !folderFailed; i++) {
+            folderFailed = true;
+            
+            std::string relativeFolder;
+            uint64_t device, inode, modificationTime, modificationTimeNsec, subfolderCount, fileCount;
+            if (!readString(file, relativeFolder) ||
+                !readUInt64(file, device) || !readUInt64(file, inode) ||
+                !readUInt64(file, modificationTime) || !readUInt64(file, modificationTimeNsec) ||
+                !readUInt64(file, subfolderCount)) break;
+            
+            FolderRecord& folderRecord = folders[relativeFolder];
+            folderRecord.device               = device;
+            folderRecord.inode                = inode;
+            folderRecord.modificationTime     = modificationTime;
+            folderRecord.modificationTimeNsec = modificationTimeNsec;
+            
+            folderRecord.subfolders.resize(subfolderCount);
+            bool subfolderFailed = false;
+            for (auto& subfolder : folderRecord.subfolders) {
+                if (!readString(file, subfolder)) { subfolderFailed = true; break; }
+            }
+            if (subfolderFailed || !readUInt64(file, fileCount)) break;
+            
+            bool fileFailed = false;
+            for (uint64_t j = 0; j < fileCount; j++) {
+                FileRecord fileRecord;
+                uint64_t size = 0, modificationTime = 0, modificationTimeNsec = 0;
+                if (!readString(file, fileRecord.filename) || !readUInt64(file, size) ||
+                    !readUInt64(file, modificationTime) || !readUInt64(file, modificationTimeNsec)) { fileFailed = true; break; }
+                
+                fileRecord.fileType    = RegularFile;
+                fileRecord.size        = size;
+                fileRecord.modificationTime     = modificationTime;
+                fileRecord.modificationTimeNsec = modificationTimeNsec;
+                fileRecord.relativePath= combine({relativeFolder, fileRecord.filename});
+                fileRecord.filePath    = combine({mountRecord.rootFolder, fileRecord.relativePath});
+                fileRecord.mountId     = mountRecord.mountId;
+                fileRecords.push_back(fileRecord);
+            }
+            if (fileFailed) break;
+            
+            folderFileCounts.push_back(std::make_pair(relativeFolder, fileCount));
+            folderFailed = false;
+        }
+        
+        succeeded = !folderFailed;
+    } while (false);
+    
+    fclose(file);
+    
+    if (!succeeded) return false;
+    
+    // commit only a fully read state
+    auto fileRecordIt = fileRecords.begin();
+    for (auto& folderFileCount : folderFileCounts) {
+        FolderRecord& folderRecord = folders[folderFileCount.first];
+        for (size_t i = 0; i < folderFileCount.second; i++, ++fileRecordIt) {
+            folderRecord.fileRecords.push_back(mountRecord.fileRecords.insert(mountRecord.fileRecords.end(), *fileRecordIt));
+        }
+    }
+    
+    mountRecord.folders.swap(folders);
+    
+    if (mountRecord.progress)
+        mountRecord.progress->entriesFound += fileRecords.size();
+    if (mountRecord.mounted)
+        shouldRebuildIndex = true;
+    
+    return true;
+}
+
+// A hot file costs a single pread on a cached descriptor.
+size_t ResourcesManagerImpl::readDataFromRegularFile(const std::string& filePath, void* buffer, int size) {
+    std::shared_ptr<FileDescriptorCache::Descriptor> descriptor = fileDescriptorCache.acquire(filePath);
+    if (!descriptor) return 0;
+    
+    char* out = static_cast<char*>(buffer);
+    size_t bytesRead = 0;
+    while (bytesRead < (size_t)size) {
+        ssize_t ret = pread(descriptor->get(), out + bytesRead, size - bytesRead, bytesRead);
+        if (ret <= 0) break;
+        bytesRead += ret;
+    }
+    
+    return bytesRead;
+}
+
+//
+// zip archive methods
+//
+
+// reads through a mapping of the archive, falls back to stdio if it can't be mapped
+static unzFile openZip(const std::string& archivePath) {
+    zlib_filefunc64_def filefunc;
+    fill_mmap_filefunc64(&filefunc);
+    
+    unzFile zipFile = unzOpen2_64(archivePath.c_str(), &filefunc);
+    if (!zipFile)
+        zipFile = unzOpen(archivePath.c_str());
+    return zipFile;
+}
+
+unzFile ResourcesManagerImpl::acquireSharedZip(const std::string& archivePath) {
+    {
+        std::lock_guard<std::mutex> lock(sharedZipFilesMutex);
+        
+        SharedZipFile& sharedZipFile = sharedZipFiles[archivePath];
+        sharedZipFile.busyCount++;
+        if (!sharedZipFile.idleZipFiles.empty()) {
+            unzFile zipFile = sharedZipFile.idleZipFiles.back();
+            sharedZipFile.idleZipFiles.pop_back();
+            return zipFile;
+        }
+    }
+    
+    // opened outside the lock, other archives' readers don't wait for it
+    unzFile zipFile = openZip(archivePath);
+    if (!zipFile) {
+        releaseSharedZip(archivePath, nullptr);
+        throw std::exception();
+    }
+    return zipFile;
+}
+
+void ResourcesManagerImpl::releaseSharedZip(const std::string& archivePath, unzFile zipFile) {
+    std::lock_guard<std::mutex> lock(sharedZipFilesMutex);
+    
+    auto it = sharedZipFiles.find(archivePath);
     if (it == sharedZipFiles.end()) {
-        unzFile zipFile = unzOpen(archivePath.c_str());
-        if (!zipFile) throw std::exception();
+        if (zipFile) unzClose(zipFile);
+        return;
+    }
+    
+    SharedZipFile& sharedZipFile = it->second;
+    sharedZipFile.busyCount--;
+    if (!sharedZipFile.closeWhenUnused) {
+        if (zipFile) sharedZipFile.idleZipFiles.push_back(zipFile);
+        return;
+    }
+    
+    if (zipFile) unzClose(zipFile);
+    if (sharedZipFile.busyCount <= 0 && sharedZipFile.streamsCount <= 0)
+        sharedZipFiles.erase(it);
+}
+
+// Idle handles are closed now, busy ones when their read is done and the
+// entry when the last stream of the archive is closed.
+void ResourcesManagerImpl::closeSharedZip(const std::string& archivePath) {
+    archiveMappings.erase(archivePath);   // views keep their mapping alive
+    fileDescriptorCache.invalidate(archivePath);
+    
+    std::lock_guard<std::mutex> lock(sharedZipFilesMutex);
+    
+    auto it = sharedZipFiles.find(archivePath);
+    if (it == sharedZipFiles.end()) return;
+    
+    for (unzFile zipFile : it->second.idleZipFiles) {
+        unzClose(zipFile);
+    }
+    it->second.idleZipFiles.clear();
+    
+    if (it->second.streamsCount > 0 || it->second.busyCount > 0) {
+        it->second.closeWhenUnused = true;
+        return;
+    }
+    
+    sharedZipFiles.erase(it);
+}
+
+void ResourcesManagerImpl::retainSharedZip(const std::string& archivePath) {
+    std::lock_guard<std::mutex> lock(sharedZipFilesMutex);
+    sharedZipFiles[archivePath].streamsCount++;
+}
+
+void ResourcesManagerImpl::releaseSharedZip(const std::string& archivePath) {
+    std::lock_guard<std::mutex> lock(sharedZipFilesMutex);
+    
+    auto it = sharedZipFiles.find(archivePath);
+    if (it == sharedZipFiles.end()) return;
+    
+    it->second.streamsCount--;
+    if (it->second.streamsCount <= 0 && it->second.busyCount <= 0 && it->second.closeWhenUnused)
+        sharedZipFiles.erase(it);
+}
+
+void ResourcesManager::addArchive(const std::string& archivePath, const std::string& rootFolder /* = "" */,
+                                  const MountFilter& filter /* = MountFilter() */) {
+    pImpl->mount("", archivePath, rootFolder, filter, "", nullptr, false).get();
+}
+
+std::shared_future<void> ResourcesManager::addArchiveAsync(const std::string& archivePath, const std::string& rootFolder /* = "" */,
+                                                           std::shared_ptr<MountProgress> progress /* = nullptr */,
+                                                           const MountFilter& filter /* = MountFilter() */) {
+    return pImpl->mount("", archivePath, rootFolder, filter, "", progress, true);
+}
+
+// Reads the whole central directory with a single pread and walks it in memory,
+// instead of going through minizip's per-entry, per-field I/O callbacks. Uses its
+// own descriptor, so it can run while shared handles are being read.
+void ResourcesManagerImpl::scanArchive(MountRecord& mountRecord) {
+    std::shared_ptr<const std::string> archivePath = std::make_shared<std::string>(mountRecord.archivePath);
+    const std::string& rootFolder = mountRecord.archiveRootFolder;
+    const MountFilter& filter = mountRecord.filter;
+    bool shouldFilter = !filter.isEmpty();
+    
+    int fd = open(archivePath->c_str(), O_RDONLY);
+    if (fd < 0) throw std::exception();
+    
+    CentralDirectory centralDirectory;
+    bool succeeded = readCentralDirectory(fd, centralDirectory);
+    close(fd);
+    if (!succeeded) throw std::exception();
+    
+    const unsigned char* data = centralDirectory.data.data();
+    size_t size = centralDirectory.data.size();
+    size_t pos = 0;
+    
+    for (uint64_t fileIndex = 0; fileIndex < centralDirectory.entriesCount; fileIndex++) {
+        if (pos + 46 > size || readLE32(data + pos) != 0x02014b50) throw std::exception();
+        
+        const unsigned char* header = data + pos;
+        uint16_t flags             = readLE16(header + 8);
+        uint16_t compressionMethod = readLE16(header + 10);
+        uint32_t crc               = readLE32(header + 16);
+        uint64_t compressedSize    = readLE32(header + 20);
+        uint64_t uncompressedSize  = readLE32(header + 24);
+        size_t filenameSize        = readLE16(header + 28);
+        size_t extraSize           = readLE16(header + 30);
+        size_t commentSize         = readLE16(header + 32);
+        uint64_t localHeaderOffset = readLE32(header + 42);
+        
+        size_t entrySize = 46 + filenameSize + extraSize + commentSize;
+        if (pos + entrySize > size) throw std::exception();
+        
+        const char* filename = reinterpret_cast<const char*>(header + 46);
+        readZip64ExtraField(header + 46 + filenameSize, extraSize, uncompressedSize, compressedSize, localHeaderOffset);
+        
+        if (mountRecord.progress)
+            mountRecord.progress->bytesParsed += entrySize;
+        
+        size_t entryPos = pos;
+        pos += entrySize;
+        
+        // skip folders and files outside specified folder
+        if (filenameSize == 0 || filename[filenameSize - 1] == '/') continue;
+        
+        size_t relativePathBegin = 0;
+        if (!rootFolder.empty()) {
+            if (filenameSize <= rootFolder.size() + 1 ||
+                rootFolder.compare(0, rootFolder.size(), filename, rootFolder.size()) != 0 ||
+                filename[rootFolder.size()] != '/') continue;
+            
+            relativePathBegin = rootFolder.size() + 1;
+        }
+        
+        FileRecord fileRecord;
+        fileRecord.filename.assign(filename, filenameSize);
+        fileRecord.relativePath.assign(filename + relativePathBegin, filenameSize - relativePathBegin);
+        
+        // skip filtered out entries
+        if (shouldFilter && !filter.matchesEntry(fileRecord.relativePath)) continue;
+        
+        fileRecord.fileType    = (compressionMethod == 0) ? StoredFile : CompressedFile;
+        fileRecord.size        = uncompressedSize;
+        fileRecord.zipFilePath = archivePath;
+        fileRecord.zipFilePos.pos_in_zip_directory = centralDirectory.offset + entryPos;
+        fileRecord.zipFilePos.num_of_file          = fileIndex;
+        fileRecord.zipLocalHeaderOffset = centralDirectory.bytesBeforeArchive + localHeaderOffset;
+        fileRecord.zipCompressedSize    = compressedSize;
+        fileRecord.zipCrc               = crc;
+        fileRecord.zipArchiveIdentity   = centralDirectory.archiveIdentity;
+        fileRecord.zipCompressionMethod = compressionMethod;
+        fileRecord.zipEncrypted         = (flags & 1) != 0;
+        fileRecord.mountId     = mountRecord.mountId;
+        mountRecord.fileRecords.push_back(std::move(fileRecord));
         
-        sharedZipFiles[archivePath] = zipFile;
-        return zipFile;
+        if (mountRecord.progress)
+            mountRecord.progress->entriesFound++;
+    }
+}
+
+size_t ResourcesManagerImpl::readDataFromCompressedFile(const FileRecord& fileRecord, void* buffer, int size) {
+    
+    SharedZipLease lease(this, *fileRecord.zipFilePath);
+    unzFile zipFile = lease.zipFile;
+    
+    unz_file_pos file_pos = fileRecord.zipFilePos;
+    int ret = unzGoToFilePos(zipFile, &file_pos);
+    if (ret != UNZ_OK) throw std::exception();
+    
+    ret = unzOpenCurrentFile(zipFile);
+    if (ret != UNZ_OK) throw std::exception();
+    
+    ret = unzReadCurrentFile(zipFile, buffer, size);
+    if (ret < 0) throw std::exception();
+    return (ret == 0) ? size : ret;
+}
+
+ResourcesManagerImpl::FileMapping::~FileMapping() {
+    if (data)
+        munmap((void*)data, size);
+}
+
+// Returns nullptr if the file can't be mapped, empty files can't.
+std::shared_ptr<ResourcesManagerImpl::FileMapping> ResourcesManagerImpl::FileMapping::create(const std::string& filePath) {
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    
+    struct stat stat_buf;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &stat_buf) == 0 && stat_buf.st_size > 0)
+        data = mmap(nullptr, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return nullptr;
+    
+    std::shared_ptr<FileMapping> mapping = std::make_shared<FileMapping>();
+    mapping->data = static_cast<const unsigned char*>(data);
+    mapping->size = stat_buf.st_size;
+    return mapping;
+}
+
+std::shared_ptr<ResourcesManagerImpl::FileMapping> ResourcesManagerImpl::mapArchive(const std::string& archivePath) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    std::shared_ptr<FileMapping>& mapping = archiveMappings[archivePath];
+    if (!mapping)
+        mapping = FileMapping::create(archivePath);
+    if (!mapping)
+        archiveMappings.erase(archivePath);
+    
+    return mapping;
+}
+
+static void adviseRange(const void* data, size_t size, MapAdvice advice) {
+    if (advice == MapAdviceNormal || size == 0) return;
+    
+    // madvise wants a page aligned start
+    uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~(pageSize - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(data) + size;
+    
+    int flag = MADV_NORMAL;
+    switch (advice) {
+        case MapAdviceSequential: flag = MADV_SEQUENTIAL; break;
+        case MapAdviceRandom:     flag = MADV_RANDOM; break;
+        case MapAdviceWillNeed:   flag = MADV_WILLNEED; break;
+        default: break;
+    }
+    madvise(reinterpret_cast<void*>(begin), end - begin, flag);
+}
+
+// Stored entries are contiguous in the archive, the view points at them inside the mapping.
+ResourceView ResourcesManagerImpl::readView(const FileRecord& fileRecord) {
+    if (fileRecord.fileType != StoredFile || fileRecord.zipCompressedSize != fileRecord.size) return ResourceView();
+    
+    std::shared_ptr<FileMapping> mapping = mapArchive(*fileRecord.zipFilePath);
+    if (!mapping) return ResourceView();
+    
+    uint64_t headerOffset = fileRecord.zipLocalHeaderOffset;
+    if (headerOffset + 30 > mapping->size) return ResourceView();
+    
+    const unsigned char* header = mapping->data + headerOffset;
+    if (readLE32(header) != 0x04034b50) return ResourceView();
+    if (readLE16(header + 6) & 1) return ResourceView();   // encrypted
+    
+    uint64_t dataOffset = headerOffset + 30 + readLE16(header + 26) + readLE16(header + 28);
+    if (dataOffset + fileRecord.size > mapping->size) return ResourceView();
+    
+    return ResourceView(reinterpret_cast<const char*>(mapping->data + dataOffset), fileRecord.size, mapping);
+}
+
+// Regular files at or above minimumMappedSize and stored entries are mapped,
+// everything else is read into a heap buffer owned by the view.
+ResourceView ResourcesManagerImpl::map(const FileRecord& fileRecord, bool* mapped /* = nullptr */) {
+    if (mapped)
+        *mapped = true;
+    
+    if (fileRecord.pinnedContents)
+        return ResourceView(fileRecord.pinnedContents.get(), fileRecord.size, fileRecord.pinnedContents);
+    
+    MapAdvice advice;
+    size_t mappedSize;
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        advice = mapAdvice;
+        mappedSize = minimumMappedSize;
+    }
+    
+    if (fileRecord.fileType == RegularFile && fileRecord.size >= mappedSize) {
+        std::shared_ptr<FileMapping> mapping = FileMapping::create(fileRecord.filePath);
+        if (mapping) {
+            adviseRange(mapping->data, mapping->size, advice);
+            return ResourceView(reinterpret_cast<const char*>(mapping->data), mapping->size, mapping);
+        }
+    }
+    else if (fileRecord.fileType == StoredFile) {
+        ResourceView view = readView(fileRecord);
+        if (view.isValid()) {
+            adviseRange(view.data(), view.size(), advice);
+            return view;
+        }
+    }
+    
+    if (mapped)
+        *mapped = false;
+    return readIntoView(fileRecord);
+}
+
+// Handles still alive are shared first, then the content cache, then a mapping or a new buffer.
+// Runs without the main mutex, concurrent readers of a key share one read.
+ResourceBlob ResourcesManagerImpl::readShared(const FileRecord& fileRecord) {
+    if (fileRecord.pinnedContents)
+        return ResourceBlob(fileRecord.pinnedContents, fileRecord.size, PinnedBacking);
+    
+    std::string key = makeContentKey(fileRecord);
+    
+    ResourceBlob sharedBlob = findSharedBlob(key);
+    if (sharedBlob.isValid()) return sharedBlob;
+    
+    // a leader without a whole file to share leaves its waiters to read it themselves
+    bool leader = false;
+    std::shared_ptr<ReadFlight> flight = joinReadFlight(key, leader);
+    if (!leader) {
+        ResourceBlob blob = flight->future.get();
+        return blob.isValid() ? blob : readSharedContents(fileRecord, key);
+    }
+    if (!flight) return readSharedContents(fileRecord, key);
+    
+    ResourceBlob blob;
+    try {
+        blob = readSharedContents(fileRecord, key);
+    }
+    catch (...) {
+        leaveReadFlight(key);
+        flight->promise.set_exception(std::current_exception());
+        throw;
+    }
+    
+    bool wholeFile = blob.isValid() && blob.size() == fileRecord.size;
+    if (wholeFile)
+        addSharedBlob(key, blob);
+    
+    leaveReadFlight(key);
+    flight->promise.set_value(wholeFile ? blob : ResourceBlob());
+    return blob;
+}
+
+ResourceBlob ResourcesManagerImpl::findSharedBlob(const std::string& key) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    auto it = sharedBlobs.find(key);
+    if (it == sharedBlobs.end()) return ResourceBlob();
+    
+    std::shared_ptr<const char> data = it->second.data.lock();
+    if (data) return ResourceBlob(data, it->second.size, it->second.backing);
+    
+    sharedBlobs.erase(it);
+    return ResourceBlob();
+}
+
+void ResourcesManagerImpl::addSharedBlob(const std::string& key, const ResourceBlob& blob) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    // drop handles that expired since the last sweep
+    if (sharedBlobs.size() >= sharedBlobsSweepSize) {
+        for (auto blobIt = sharedBlobs.begin(); blobIt != sharedBlobs.end();) {
+            if (blobIt->second.data.expired())
+                sharedBlobs.erase(blobIt++);
+            else
+                ++blobIt;
+        }
+        sharedBlobsSweepSize = std::max<size_t>(64, sharedBlobs.size() * 2);
+    }
+    
+    if (!blob.isValid()) return;
+    
+    SharedBlob& sharedBlob = sharedBlobs[key];
+    sharedBlob.data = blob.blobData;
+    sharedBlob.size = blob.size();
+    sharedBlob.backing = blob.getBacking();
+}
+
+ResourceBlob ResourcesManagerImpl::readSharedContents(const FileRecord& fileRecord, const std::string& key) {
+    // the read below fills the shared segment on a miss
+    const char* sharedData = nullptr;
+    std::shared_ptr<const void> sharedBacking;
+    std::string extractedKey = (fileRecord.fileType == CompressedFile && sharedMemoryCache.isOpen()) ? makeExtractedKey(fileRecord) : "";
+    if (!extractedKey.empty() &&
+        sharedMemoryCache.lookup(extractedKey, fileRecord.size, sharedData, sharedBacking)) {
+        return ResourceBlob(std::shared_ptr<const char>(sharedBacking, sharedData), fileRecord.size, SharedMemoryBacking);
+    }
+    
+    if (shouldCacheContents(fileRecord)) {
+        std::shared_ptr<const char> contents;
+        size_t size = 0;
+        if (contentCache.lookup(key, contents, size))
+            return ResourceBlob(contents, size, CacheBacking);
+        
+        std::shared_ptr<char> buffer(new char[fileRecord.size + 1], std::default_delete<char[]>());
+        size = readDataUncached(fileRecord, buffer.get(), fileRecord.size);
+        if (size != fileRecord.size) throw std::exception();
+        
+        bool cached = contentCache.insert(key, buffer, size);
+        return ResourceBlob(buffer, size, cached ? CacheBacking : HeapBacking);
+    }
+    
+    bool mapped = false;
+    ResourceView view = map(fileRecord, &mapped);
+    if (!view.isValid()) return ResourceBlob();
+    
+    // aliases the view's backing, the blob keeps it alive
+    std::shared_ptr<const char> data(view.backing, view.data());
+    return ResourceBlob(data, view.size(), mapped ? MappingBacking : HeapBacking);
+}
+
+// The first reader of a key leads and does the read, the others get its flight to wait on.
+// Returns nullptr to a leader reading the key again, readShared reads through readData.
+std::shared_ptr<ResourcesManagerImpl::ReadFlight> ResourcesManagerImpl::joinReadFlight(const std::string& key, bool& leader) {
+    std::lock_guard<std::mutex> lock(readFlightsMutex);
+    
+    std::shared_ptr<ReadFlight>& flight = readFlights[key];
+    leader = !flight;
+    if (leader) {
+        flight = std::make_shared<ReadFlight>();
+        flight->future = flight->promise.get_future().share();
+        flight->leaderThreadId = std::this_thread::get_id();
+    }
+    else if (flight->leaderThreadId == std::this_thread::get_id()) {
+        leader = true;
+        return nullptr;
+    }
+    else {
+        flight->waitersCount++;
+    }
+    return flight;
+}
+
+// Called by the leader before it publishes the result, later readers start a new read.
+// Returns how many readers wait for the result.
+size_t ResourcesManagerImpl::leaveReadFlight(const std::string& key) {
+    std::lock_guard<std::mutex> lock(readFlightsMutex);
+    
+    auto it = readFlights.find(key);
+    size_t waitersCount = it->second->waitersCount;
+    readFlights.erase(it);
+    return waitersCount;
+}
+
+ResourceView ResourcesManagerImpl::readIntoView(const FileRecord& fileRecord) {
+    if (fileRecord.fileType != RegularFile) {
+        std::shared_ptr<char> buffer(new char[fileRecord.size + 1], std::default_delete<char[]>());
+        size_t bytesRead = readData(fileRecord, buffer.get(), fileRecord.size);
+        return ResourceView(buffer.get(), bytesRead, buffer);
+    }
+    
+    int fd = open(fileRecord.filePath.c_str(), O_RDONLY);
+    if (fd < 0) return ResourceView();
+    
+    // the file may have changed since it was scanned
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        close(fd);
+        return ResourceView();
+    }
+    
+    size_t size = stat_buf.st_size;
+    std::shared_ptr<char> buffer(new char[size + 1], std::default_delete<char[]>());
+    bool succeeded = preadFully(fd, buffer.get(), size, 0);
+    close(fd);
+    if (!succeeded) return ResourceView();
+    
+    return ResourceView(buffer.get(), size, buffer);
+}
+
+void ResourcesManagerImpl::checkZipFileOpened(StreamRecord* streamRecord) {
+    if (!streamRecord->zipFile) {
+        streamRecord->zipFile = openZip(*streamRecord->fileRecord.zipFilePath);
+        if (!streamRecord->zipFile) throw std::exception();
+        
+        int ret = unzGoToFilePos(streamRecord->zipFile, &streamRecord->fileRecord.zipFilePos);
+        if (ret != UNZ_OK) throw std::exception();
+        
+        ret = unzOpenCurrentFile(streamRecord->zipFile);
+        if (ret != UNZ_OK) throw std::exception();
+    }
+}
+
+//
+// common methods
+//
+
+void ResourcesManagerImpl::traceFileRecord(const std::string& key, const FileRecord& fileRecord) {
+    
+    std::cout << key << ": ";
+    
+    if (fileRecord.zipFilePath)
+        std::cout << "zip: " << basename(*fileRecord.zipFilePath) << ", ";
+    
+    std::cout << "relative path: " << fileRecord.relativePath << ", ";
+        
+    if (!fileRecord.category.empty())
+        std::cout << "category: " << fileRecord.category << ", ";
+    
+    std::cout << "size: " << fileRecord.size << std::endl;
+}
+
+std::string ResourcesManagerImpl::makeKey(const std::string& filename) {
+    std::string key = searchByRelativePaths ? filename :  basename(filename);
+    lowercase(key);
+    replaceAll(key, "\\\\", "/");
+    std::replace(key.begin(), key.end(), '\\', '/');
+//    filenameId = removeExtension(filenameId);
+    
+    return key;
+}
+
+// Computes the index keys of a record for the current language, categories and
+// search roots. Returns false if the record is filtered out.
+bool ResourcesManagerImpl::makeIndexKeys(FileRecord& fileRecord, std::vector<std::string>& keys) {
+    std::string relativePathInMap = fileRecord.relativePath;
+    lowercase(relativePathInMap);
+
+    for (auto& folderLanguageIdPair :  relativeFolderToLanguageIdMap) {
+        std::string pathComponentToSearch = folderLanguageIdPair.first + "/";
+        if (relativePathInMap.find(pathComponentToSearch) != std::string::npos)
+        {
+            if (languageId != folderLanguageIdPair.second) {
+                return false;
+            }
+            
+            fileRecord.languageId = folderLanguageIdPair.second;
+            replaceAll(relativePathInMap, pathComponentToSearch, "");
+        }
+    }
+
+    for (auto& folderCategoryPair :  lowercaseFolderToCategoryMap) {
+        if (relativePathInMap.find(folderCategoryPair.first) != std::string::npos)
+        {
+            if (enabledCategories.count(folderCategoryPair.second) == 0) {
+                return false;
+            }
+            
+            fileRecord.category = folderCategoryPair.second;
+            replaceAll(relativePathInMap, folderCategoryPair.first, "");
+        }
+    }
+
+    keys.push_back(makeKey(relativePathInMap));
+    
+    for (auto& searchRoot : lowercaseSearchRootsList) {
+        if (searchRoot.empty()) continue;
+        
+        if (relativePathInMap.compare(0, searchRoot.size(), searchRoot) == 0) {
+            std::string searchRootRelativePath = relativePathInMap.substr(searchRoot.size());
+            keys.push_back(makeKey(searchRootRelativePath));
+        }
+    }
+    
+    return true;
+}
+
+// The record goes into its mount's shard, and into the merged index unless a
+// later mount already has the key.
+void ResourcesManagerImpl::indexFileRecord(MountRecord& mountRecord, FileRecord& fileRecord) {
+    std::vector<std::string> keys;
+    
+    fileRecord.shadowsFileRecord = false;
+    if (!makeIndexKeys(fileRecord, keys)) return;
+    
+    for (auto& key : keys) {
+        FileRecord*& shardFileRecord = mountRecord.index[key];
+        if (shardFileRecord && shardFileRecord != &fileRecord)
+            fileRecord.shadowsFileRecord = true;
+        shardFileRecord = &fileRecord;
+        
+        FileRecord*& indexedFileRecord = fileRecordIndex[key];
+        if (indexedFileRecord && indexedFileRecord->mountId > fileRecord.mountId) continue;
+        indexedFileRecord = &fileRecord;
+        
+        if (enableTrace)
+            traceFileRecord(key, fileRecord);
+    }
+}
+
+void ResourcesManagerImpl::unindexFileRecord(MountRecord& mountRecord, FileRecord& fileRecord) {
+    // the shadowed record of the same mount is not known, so bring it back with a full rebuild
+    if (fileRecord.shadowsFileRecord) {
+        shouldRebuildIndex = true;
+        return;
+    }
+    
+    std::vector<std::string> keys;
+    if (!makeIndexKeys(fileRecord, keys)) return;
+    
+    for (auto& key : keys) {
+        auto shardIt = mountRecord.index.find(key);
+        if (shardIt != mountRecord.index.end() && shardIt->second == &fileRecord)
+            mountRecord.index.erase(shardIt);
+        
+        auto it = fileRecordIndex.find(key);
+        if (it != fileRecordIndex.end() && it->second == &fileRecord) {
+            FileRecord* shadowedFileRecord = findShadowedFileRecord(key, mountRecord);
+            if (shadowedFileRecord)
+                it->second = shadowedFileRecord;
+            else
+                fileRecordIndex.erase(it);
+        }
+    }
+}
+
+// latest mount other than the given one that has the key
+FileRecord* ResourcesManagerImpl::findShadowedFileRecord(const std::string& key, const MountRecord& removedMountRecord) {
+    for (auto it = mountsList.rbegin(); it != mountsList.rend(); ++it) {
+        if (&*it == &removedMountRecord || !it->mounted) continue;
+        
+        auto shardIt = it->index.find(key);
+        if (shardIt != it->index.end())
+            return shardIt->second;
+    }
+    
+    return nullptr;
+}
+
+void ResourcesManagerImpl::rebuildIndex() {
+    fileRecordIndex.clear();
+    
+    // prepare lowercase dictionaries
+    lowercaseFolderToCategoryMap.clear();
+    for (auto& folderCategoryPair : relativeFolderToCategoryMap) {
+        std::string relativePath = folderCategoryPair.first;
+        lowercase(relativePath);
+        
+        lowercaseFolderToCategoryMap[relativePath + "/"] = folderCategoryPair.second;
+    }
+    
+    lowercaseSearchRootsList.clear();
+    for (auto searchRoot : searchRootsList) {
+        if (searchRoot.empty()) continue;
+        
+        lowercase(searchRoot);
+        replaceAll(searchRoot, "\\\\", "/");
+
+        lowercaseSearchRootsList.push_back(searchRoot + "/");
+    }
+    
+    for (auto& mountRecord : mountsList) {
+        mountRecord.index.clear();
+        if (!mountRecord.mounted) continue;
+        
+        for (auto& fileRecord : mountRecord.fileRecords) {
+            indexFileRecord(mountRecord, fileRecord);
+        }
+    }
+    
+    shouldRebuildIndex = false;
+}
+
+void ResourcesManager::rebuildIndex() {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    pImpl->rebuildIndex();
+}
+
+FileRecord* ResourcesManagerImpl::findFileRecord(const std::string& filename) {
+    
+    if (shouldRebuildIndex) {
+        rebuildIndex();
+    }
+    
+    std::string key = makeKey(filename);
+    
+    auto it = fileRecordIndex.find(key);
+    if (it == fileRecordIndex.end()) {
+        return nullptr;
+    }
+    
+    return it->second;
+}
+
+// Reads work on a copy, the record may be removed while they run.
+bool ResourcesManagerImpl::copyFileRecord(const std::string& filename, FileRecord& fileRecord) {
+    waitForMounts(filename);
+    
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    FileRecord* foundFileRecord = findFileRecord(filename);
+    if (!foundFileRecord) return false;
+    
+    fileRecord = *foundFileRecord;
+    return true;
+}
+
+bool ResourcesManager::exists(const std::string& filename) {
+    pImpl->waitForMounts(filename);
+
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    
+    return (pImpl->findFileRecord(filename) != nullptr);
+}
+
+// Whole file reads of cacheable records go through the content cache,
+// partial reads are only served from it. Concurrent whole file reads of
+// a record share one read, runs without the main mutex.
+size_t ResourcesManagerImpl::readData(const FileRecord& fileRecord, void* buffer, int size) {
+    if (fileRecord.pinnedContents) {
+        size_t bytesRead = std::min<size_t>(size, fileRecord.size);
+        memcpy(buffer, fileRecord.pinnedContents.get(), bytesRead);
+        return bytesRead;
+    }
+    
+    bool shouldCache = shouldCacheContents(fileRecord);
+    bool wholeFile = (size_t)size >= fileRecord.size;
+    if (!shouldCache && !wholeFile) return readDataUncached(fileRecord, buffer, size);
+    
+    std::string key = makeContentKey(fileRecord);
+    
+    std::shared_ptr<const char> contents;
+    size_t contentsSize = 0;
+    if (shouldCache && contentCache.lookup(key, contents, contentsSize)) {
+        size_t bytesRead = std::min<size_t>(size, contentsSize);
+        memcpy(buffer, contents.get(), bytesRead);
+        return bytesRead;
+    }
+    
+    if (!wholeFile) return readDataUncached(fileRecord, buffer, size);
+    
+    // a leader without a whole file to share leaves its waiters to read it themselves
+    bool leader = false;
+    std::shared_ptr<ReadFlight> flight = joinReadFlight(key, leader);
+    if (!leader) {
+        ResourceBlob blob = flight->future.get();
+        if (!blob.isValid()) return readDataUncached(fileRecord, buffer, size);
+        
+        size_t bytesRead = std::min<size_t>(size, blob.size());
+        memcpy(buffer, blob.data(), bytesRead);
+        return bytesRead;
+    }
+    
+    size_t bytesRead = 0;
+    try {
+        bytesRead = readDataUncached(fileRecord, buffer, size);
+    }
+    catch (...) {
+        if (flight) {
+            leaveReadFlight(key);
+            flight->promise.set_exception(std::current_exception());
+        }
+        throw;
+    }
+    
+    // the buffer is the caller's, the cache and the waiting readers get a copy
+    std::shared_ptr<char> copy;
+    bool cached = false;
+    if (shouldCache && bytesRead == fileRecord.size) {
+        copy.reset(new char[bytesRead + 1], std::default_delete<char[]>());
+        memcpy(copy.get(), buffer, bytesRead);
+        cached = contentCache.insert(key, copy, bytesRead);
+    }
+    
+    if (!flight) return bytesRead;
+    
+    // the count is taken under the flights lock as the flight is closed, a reader
+    // coming later starts a read of its own and never sees the caller's buffer
+    size_t waitersCount = leaveReadFlight(key);
+    if (bytesRead != fileRecord.size) {
+        flight->promise.set_value(ResourceBlob());
+        return bytesRead;
+    }
+    if (waitersCount > 0 && !copy) {
+        copy.reset(new char[bytesRead + 1], std::default_delete<char[]>());
+        memcpy(copy.get(), buffer, bytesRead);
+    }
+    flight->promise.set_value(copy ? ResourceBlob(copy, bytesRead, cached ? CacheBacking : HeapBacking) : ResourceBlob());
+    return bytesRead;
+}
+
+size_t ResourcesManagerImpl::readDataUncached(const FileRecord& fileRecord, void* buffer, int size) {
+    if (fileRecord.fileType == RegularFile) {
+        return readDataFromRegularFile(fileRecord.filePath, buffer, size);
+    }
+    else if (fileRecord.fileType == CompressedFile || fileRecord.fileType == StoredFile) {
+        if (fileRecord.fileType != CompressedFile) return readDataFromArchive(fileRecord, buffer, size);
+        
+        size_t diskMinimumSize;
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            diskMinimumSize = diskCacheMinimumSize;
+        }
+        
+        bool useSharedMemory = sharedMemoryCache.isOpen();
+        bool useDisk = fileRecord.size >= diskMinimumSize && diskCache.isEnabled();
+        if (!useSharedMemory && !useDisk) return readDataFromArchive(fileRecord, buffer, size);
+        
+        // extracted copies are keyed by contents rather than by name
+        std::string key = makeExtractedKey(fileRecord);
+        
+        size_t bytesRead = 0;
+        const char* sharedData = nullptr;
+        std::shared_ptr<const void> sharedBacking;
+        if (useSharedMemory && sharedMemoryCache.lookup(key, fileRecord.size, sharedData, sharedBacking)) {
+            bytesRead = std::min<size_t>(size, fileRecord.size);
+            memcpy(buffer, sharedData, bytesRead);
+            return bytesRead;
+        }
+        
+        if (!useDisk || !diskCache.read(key, fileRecord.size, fileRecord.zipCrc, buffer, size, bytesRead)) {
+            bytesRead = readDataFromArchive(fileRecord, buffer, size);
+            if (useDisk && bytesRead == fileRecord.size)
+                diskCache.write(key, buffer, bytesRead);
+        }
+        
+        if (useSharedMemory && bytesRead == fileRecord.size)
+            sharedMemoryCache.insert(key, buffer, bytesRead);
+        return bytesRead;
+    }
+
+    return 0;
+}
+
+std::string ResourcesManagerImpl::makeExtractedKey(const FileRecord& fileRecord) {
+    char key[64];
+    snprintf(key, sizeof(key), "%016llx-%08x-%llu", (unsigned long long)fileRecord.zipArchiveIdentity,
+             (unsigned)fileRecord.zipCrc, (unsigned long long)fileRecord.size);
+    return key;
+}
+
+size_t ResourcesManagerImpl::readDataFromArchive(const FileRecord& fileRecord, void* buffer, int size) {
+    if (fileRecord.fileType == CompressedFile && fileRecord.zipCompressionMethod == Z_DEFLATED && !fileRecord.zipEncrypted &&
+        compressedCache.getCapacity() > 0 && !shouldCacheContents(fileRecord))
+        return readDataThroughCompressedCache(fileRecord, buffer, size);
+    
+    return readDataFromCompressedFile(fileRecord, buffer, size);
+}
+
+// Every thread keeps its inflate state and window between entries, reset instead
+// of allocated again for each one.
+static pthread_key_t threadInflateStreamKey;
+static pthread_once_t threadInflateStreamKeyOnce = PTHREAD_ONCE_INIT;
+
+static void deleteThreadInflateStream(void* stream) {
+    inflateEnd(static_cast<z_stream*>(stream));
+    delete static_cast<z_stream*>(stream);
+}
+
+static void createThreadInflateStreamKey() {
+    pthread_key_create(&threadInflateStreamKey, deleteThreadInflateStream);
+}
+
+static z_stream& threadInflateStream() {
+    pthread_once(&threadInflateStreamKeyOnce, createThreadInflateStreamKey);
+    
+    z_stream* stream = static_cast<z_stream*>(pthread_getspecific(threadInflateStreamKey));
+    if (stream) {
+        if (inflateReset(stream) != Z_OK) throw std::exception();
+        return *stream;
+    }
+    
+    stream = new z_stream();
+    if (inflateInit2(stream, -MAX_WBITS) != Z_OK) {
+        delete stream;
+        throw std::exception();
+    }
+    pthread_setspecific(threadInflateStreamKey, stream);
+    return *stream;
+}
+
+// a smaller buffer than the file is a partial read
+static size_t inflateRawData(const char* rawData, size_t rawSize, void* buffer, int size) {
+    z_stream& stream = threadInflateStream();
+    
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(rawData));
+    stream.avail_in = (uInt)rawSize;
+    stream.next_out = static_cast<Bytef*>(buffer);
+    stream.avail_out = (uInt)size;
+    
+    int ret = inflate(&stream, Z_FINISH);
+    size_t bytesRead = size - stream.avail_out;
+    
+    if (ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && stream.avail_out == 0)) throw std::exception();
+    return bytesRead;
+}
+
+// Inflates the cached raw payload, compressed entries keep 3-5 times more
+// resources resident than inflated ones under the same budget.
+size_t ResourcesManagerImpl::readDataThroughCompressedCache(const FileRecord& fileRecord, void* buffer, int size) {
+    std::string key = makeContentKey(fileRecord);
+    
+    std::shared_ptr<const char> rawData;
+    size_t rawSize = 0;
+    if (!compressedCache.lookup(key, rawData, rawSize)) {
+        rawData = readRawData(fileRecord);
+        rawSize = fileRecord.zipCompressedSize;
+        compressedCache.insert(key, rawData, rawSize);
+    }
+    
+    return inflateRawData(rawData.get(), rawSize, buffer, size);
+}
+
+// compressed bytes of the entry, as stored in the archive
+std::shared_ptr<const char> ResourcesManagerImpl::readRawData(const FileRecord& fileRecord) {
+    SharedZipLease lease(this, *fileRecord.zipFilePath);
+    unzFile zipFile = lease.zipFile;
+    
+    unz_file_pos file_pos = fileRecord.zipFilePos;
+    if (unzGoToFilePos(zipFile, &file_pos) != UNZ_OK) throw std::exception();
+    
+    int method = 0, level = 0;
+    if (unzOpenCurrentFile2(zipFile, &method, &level, 1) != UNZ_OK) throw std::exception();
+    
+    std::shared_ptr<char> rawData(new char[fileRecord.zipCompressedSize + 1], std::default_delete<char[]>());
+    size_t bytesRead = 0;
+    while (bytesRead < fileRecord.zipCompressedSize) {
+        unsigned chunkSize = (unsigned)std::min<uint64_t>(fileRecord.zipCompressedSize - bytesRead, 1 << 30);
+        int ret = unzReadCurrentFile(zipFile, rawData.get() + bytesRead, chunkSize);
+        if (ret <= 0) break;
+        bytesRead += ret;
+    }
+    unzCloseCurrentFile(zipFile);
+    
+    if (bytesRead != fileRecord.zipCompressedSize) throw std::exception();
+    return rawData;
+}
+
+bool ResourcesManagerImpl::shouldCacheContents(const FileRecord& fileRecord) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    if (contentCacheOptions.capacity == 0) return false;
+    if (contentCacheOptions.compressedOnly && fileRecord.fileType != CompressedFile) return false;
+    
+    return fileRecord.size >= contentCacheOptions.minimumSize && fileRecord.size <= contentCacheOptions.maximumSize;
+}
+
+std::string ResourcesManagerImpl::makeContentKey(const FileRecord& fileRecord) {
+    if (fileRecord.fileType == RegularFile) return fileRecord.filePath;
+    
+    std::string key = *fileRecord.zipFilePath;
+    key += '\0';
+    key += fileRecord.filename;
+    return key;
+}
+
+// also called by scans running without the lock
+void ResourcesManagerImpl::invalidateCachedFile(const FileRecord& fileRecord) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    if (fileRecord.fileType == RegularFile)
+        fileDescriptorCache.invalidate(fileRecord.filePath);
+    
+    std::string key = makeContentKey(fileRecord);
+    contentCache.invalidate(key);
+    compressedCache.invalidate(key);
+    sharedBlobs.erase(key);
+}
+
+// Pins are counted, a record is loaded on its first pin. Records of the same file
+// in several mounts share the contents. Called without the lock with a copy of the
+// record found for filename: the contents are read without it, and the record is
+// looked up again to be pinned in case it was unmounted or replaced meanwhile.
+ResourcesManagerImpl::PinResult ResourcesManagerImpl::pin(const std::string& filename, const FileRecord& fileRecord) {
+    std::string key = makeContentKey(fileRecord);
+    
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        
+        FileRecord* foundFileRecord = findFileRecord(filename);
+        if (!foundFileRecord || makeContentKey(*foundFileRecord) != key) return PinResultMissing;
+        if (addPin(*foundFileRecord)) return PinResultPinned;
+        if (pinnedSize + fileRecord.size > pinnedBudget) return PinResultOverBudget;
+    }
+    
+    std::shared_ptr<char> contents(new char[fileRecord.size + 1], std::default_delete<char[]>());
+    size_t bytesRead = readDataUncached(fileRecord, contents.get(), fileRecord.size);
+    if (bytesRead != fileRecord.size) return PinResultFailed;
+    
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    FileRecord* foundFileRecord = findFileRecord(filename);
+    if (!foundFileRecord || makeContentKey(*foundFileRecord) != key) return PinResultMissing;
+    
+    return addPinnedFile(*foundFileRecord, contents, bytesRead) ? PinResultPinned : PinResultOverBudget;
+}
+
+// counts one more pin of a loaded file
+bool ResourcesManagerImpl::addPin(FileRecord& fileRecord) {
+    auto it = pinnedFiles.find(makeContentKey(fileRecord));
+    if (it == pinnedFiles.end()) return false;
+    
+    it->second.pinCount++;
+    fileRecord.pinnedContents = it->second.contents;
+    return true;
+}
+
+// the contents may have been read without the lock, so the file may be pinned meanwhile
+bool ResourcesManagerImpl::addPinnedFile(FileRecord& fileRecord, const std::shared_ptr<char>& contents, size_t bytesRead) {
+    if (addPin(fileRecord)) return true;
+    
+    if (pinnedSize + bytesRead > pinnedBudget) return false;
+    
+    std::string key = makeContentKey(fileRecord);
+    PinnedFile& pinnedFile = pinnedFiles[key];
+    pinnedFile.contents = contents;
+    pinnedFile.size = bytesRead;
+    pinnedFile.pinCount = 1;
+    pinnedSize += bytesRead;
+    
+    fileRecord.pinnedContents = contents;
+    
+    // the cached copy is no longer needed
+    contentCache.invalidate(key);
+    return true;
+}
+
+void ResourcesManagerImpl::unpin(FileRecord& fileRecord) {
+    std::string key = makeContentKey(fileRecord);
+    auto it = pinnedFiles.find(key);
+    if (it == pinnedFiles.end()) return;
+    
+    if (--it->second.pinCount > 0) return;
+    
+    removePinnedFile(key);
+}
+
+// After a rescan, the file may have been rewritten. The old contents stay pinned
+// until the new ones are read, a file that no longer fits the budget is unpinned.
+bool ResourcesManagerImpl::reloadPinnedFile(FileRecord& fileRecord) {
+    std::string key = makeContentKey(fileRecord);
+    auto it = pinnedFiles.find(key);
+    if (it == pinnedFiles.end()) return false;
+    
+    FileRecord unpinnedFileRecord = fileRecord;
+    unpinnedFileRecord.pinnedContents.reset();
+    
+    std::shared_ptr<char> contents(new char[fileRecord.size + 1], std::default_delete<char[]>());
+    size_t bytesRead = 0;
+    try {
+        bytesRead = readDataUncached(unpinnedFileRecord, contents.get(), fileRecord.size);
+    }
+    catch (...) {
+    }
+    
+    if (bytesRead != fileRecord.size) {
+        if (enableTrace)
+            std::cout << key << ": pinned contents not reloaded" << std::endl;
+        return false;
+    }
+    
+    if (pinnedSize - it->second.size + bytesRead > pinnedBudget) {
+        if (enableTrace)
+            std::cout << key << ": unpinned, over the pinned budget" << std::endl;
+        removePinnedFile(key);
+        fileRecord.pinnedContents.reset();
+        return false;
+    }
+    
+    pinnedSize = pinnedSize - it->second.size + bytesRead;
+    it->second.contents = contents;
+    it->second.size = bytesRead;
+    for (auto pinnedFileRecord : findPinnedFileRecords(key)) {
+        pinnedFileRecord->pinnedContents = contents;
+    }
+    fileRecord.pinnedContents = contents;
+    return true;
+}
+
+// Gives the budget back. Records of every mount share the contents, all of them
+// are unpinned so none is served the dropped contents.
+void ResourcesManagerImpl::removePinnedFile(const std::string& key) {
+    auto it = pinnedFiles.find(key);
+    if (it == pinnedFiles.end()) return;
+    
+    pinnedSize -= it->second.size;
+    pinnedFiles.erase(it);
+    for (auto fileRecord : findPinnedFileRecords(key)) {
+        fileRecord->pinnedContents.reset();
+    }
+}
+
+// A pinned record was dropped, the pin stays while another record has the contents.
+void ResourcesManagerImpl::releasePinnedFile(const std::string& key) {
+    if (findPinnedFileRecords(key).empty())
+        removePinnedFile(key);
+}
+
+// Costs O(records), only unpins and reloads of pinned files get here.
+std::vector<FileRecord*> ResourcesManagerImpl::findPinnedFileRecords(const std::string& key) {
+    std::vector<FileRecord*> fileRecords;
+    for (auto& mountRecord : mountsList) {
+        for (auto& fileRecord : mountRecord.fileRecords) {
+            if (fileRecord.pinnedContents && makeContentKey(fileRecord) == key)
+                fileRecords.push_back(&fileRecord);
+        }
+    }
+    return fileRecords;
+}
+
+size_t ResourcesManager::readData(const std::string& filename, void* buffer, int size) {
+    FileRecord fileRecord;
+    if (!pImpl->copyFileRecord(filename, fileRecord)) return 0;
+    pImpl->recordAccess(filename);
+    
+    return pImpl->readData(fileRecord, buffer, size);
+}
+
+std::unique_ptr<char[]> ResourcesManager::readData(const std::string& filename, size_t* pBytesRead) {
+    FileRecord fileRecord;
+    if (!pImpl->copyFileRecord(filename, fileRecord)) {
+        if (pBytesRead)
+            *pBytesRead = 0;
+        return nullptr;
+    }
+    pImpl->recordAccess(filename);
+    
+    std::unique_ptr<char[]> buffer(new char[fileRecord.size]);
+    size_t bytesRead = pImpl->readData(fileRecord, buffer.get(), fileRecord.size);
+    if (bytesRead != fileRecord.size) throw std::exception();
+
+    if (pBytesRead)
+        *pBytesRead = bytesRead;
+    
+    return buffer;
+}
+
+char* ResourcesManager::readData(const std::string& filename, size_t* pBytesRead,
+                                 const AllocateFunction& allocate, const DeallocateFunction& deallocate /* = nullptr */) {
+    if (pBytesRead)
+        *pBytesRead = 0;
+    
+    FileRecord fileRecord;
+    if (!pImpl->copyFileRecord(filename, fileRecord)) return nullptr;
+    pImpl->recordAccess(filename);
+    
+    char* buffer = static_cast<char*>(allocate(fileRecord.size));
+    if (!buffer) throw std::bad_alloc();
+    
+    try {
+        size_t bytesRead = pImpl->readData(fileRecord, buffer, fileRecord.size);
+        if (bytesRead != fileRecord.size) throw std::exception();
+    }
+    catch (...) {
+        if (deallocate)
+            deallocate(buffer, fileRecord.size);
+        throw;
+    }
+    
+    if (pBytesRead)
+        *pBytesRead = fileRecord.size;
+    
+    return buffer;
+}
+
+char* ResourcesManager::readData(const std::string& filename, size_t* bytesRead, ReadArena& arena) {
+    return readData(filename, bytesRead, [&arena](size_t size) {
+        return arena.allocate(size);
+    });
+}
+
+#ifdef RESOURCES_MANAGER_MEMORY_RESOURCE
+char* ResourcesManager::readData(const std::string& filename, size_t* bytesRead, std::pmr::memory_resource* resource) {
+    return readData(filename, bytesRead, [resource](size_t size) {
+        return resource->allocate(size);
+    }, [resource](void* buffer, size_t size) {
+        resource->deallocate(buffer, size);
+    });
+}
+#endif
+
+//
+// asynchronous reads
+//
+
+IOScheduler& ResourcesManagerImpl::getIOScheduler() {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    // reads mostly wait for the device, more of them than cores keep its queue full
+    if (!ioScheduler)
+        ioScheduler.reset(new IOScheduler(ThreadPool::getDefaultThreadsCount() * 2));
+    return *ioScheduler;
+}
+
+std::shared_ptr<ThreadPool> ResourcesManagerImpl::getInflateThreadPool() {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
+    if (!inflateThreadPool) {
+        size_t threadsCount = inflateThreadsCount ? inflateThreadsCount : ThreadPool::getDefaultThreadsCount();
+        inflateThreadPool = ThreadPool::makeShared(threadsCount, inflateThreadsCpus);
+    }
+    return inflateThreadPool;
+}
+
+// the old pool is destroyed once the last caller holding it is done, after its queued tasks ran,
+// off its own threads when that caller is one of its tasks
+void ResourcesManager::setInflateThreads(size_t threadsCount, const std::vector<int>& cpus /* = std::vector<int>() */) {
+    std::shared_ptr<ThreadPool> oldThreadPool;
+    {
+        std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+        
+        pImpl->inflateThreadsCount = threadsCount;
+        pImpl->inflateThreadsCpus = cpus;
+        oldThreadPool.swap(pImpl->inflateThreadPool);
+    }
+}
+
+size_t ResourcesManager::getInflateThreadsCount() {
+    return pImpl->getInflateThreadPool()->getThreadsCount();
+}
+
+// The name is resolved now, the scheduler limits the bytes the read will do.
+void ResourcesManagerImpl::startAsyncRead(std::shared_ptr<AsyncRead> asyncRead, const std::string& filename, const ReadOptions& options) {
+    if (!copyFileRecord(filename, asyncRead->fileRecord)) {
+        finishAsyncRead(asyncRead, ResourceBlob(), 0);
+        return;
+    }
+    recordAccess(filename);
+    
+    scheduleAsyncRead(asyncRead, options);
+}
+
+// what a read of the record costs against its priority class limit
+size_t ResourcesManagerImpl::getReadBytes(const FileRecord& fileRecord) {
+    if (fileRecord.pinnedContents) return 0;
+    return fileRecord.fileType == RegularFile ? fileRecord.size : fileRecord.zipCompressedSize;
+}
+
+void ResourcesManagerImpl::scheduleAsyncRead(std::shared_ptr<AsyncRead> asyncRead, const ReadOptions& options) {
+    getIOScheduler().enqueue(options.priority, getReadBytes(asyncRead->fileRecord), options.deadline, options.cancellation,
+                             std::bind(&ResourcesManagerImpl::runAsyncRead, this, asyncRead),
+                             std::bind(&ResourcesManagerImpl::finishAsyncRead, this, asyncRead, ResourceBlob(), 0));
+}
+
+// Deflated entries that don't go through the extracted copy tiers are split into
+// a raw read and an inflate, everything else is read on the read thread.
+bool ResourcesManagerImpl::shouldInflateAsync(const FileRecord& fileRecord) {
+    if (fileRecord.fileType != CompressedFile || fileRecord.zipCompressionMethod != Z_DEFLATED || fileRecord.zipEncrypted) return false;
+    if (fileRecord.pinnedContents || sharedMemoryCache.isOpen()) return false;
+    
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return fileRecord.size < diskCacheMinimumSize || !diskCache.isEnabled();
+}
+
+void ResourcesManagerImpl::runAsyncRead(std::shared_ptr<AsyncRead> asyncRead) {
+    try {
+        const FileRecord& fileRecord = asyncRead->fileRecord;
+        if (!shouldInflateAsync(fileRecord)) {
+            if (asyncRead->buffer) {
+                finishAsyncRead(asyncRead, ResourceBlob(), readData(fileRecord, asyncRead->buffer, asyncRead->size));
+            }
+            else {
+                ResourceBlob blob = readShared(fileRecord);
+                finishAsyncRead(asyncRead, blob, blob.size());
+            }
+            return;
+        }
+        
+        std::string key = makeContentKey(fileRecord);
+        
+        ResourceBlob blob = asyncRead->buffer ? ResourceBlob() : findSharedBlob(key);
+        if (blob.isValid()) {
+            finishAsyncRead(asyncRead, blob, blob.size());
+            return;
+        }
+        
+        bool shouldCache = shouldCacheContents(fileRecord);
+        std::shared_ptr<const char> contents;
+        size_t contentsSize = 0;
+        if (shouldCache && contentCache.lookup(key, contents, contentsSize)) {
+            finishAsyncRead(asyncRead, ResourceBlob(contents, contentsSize, CacheBacking), contentsSize);
+            return;
+        }
+        
+        // same tier as readDataFromArchive
+        std::shared_ptr<const char> rawData;
+        size_t rawSize = fileRecord.zipCompressedSize;
+        bool useCompressedCache = !shouldCache && compressedCache.getCapacity() > 0;
+        if (!useCompressedCache || !compressedCache.lookup(key, rawData, rawSize)) {
+            rawData = readRawData(fileRecord);
+            rawSize = fileRecord.zipCompressedSize;
+            if (useCompressedCache)
+                compressedCache.insert(key, rawData, rawSize);
+        }
+        
+        getInflateThreadPool()->enqueue(std::bind(&ResourcesManagerImpl::inflateAsyncRead, this, asyncRead, rawData, rawSize, shouldCache));
+    }
+    catch (...) {
+        failAsyncRead(asyncRead, std::current_exception());
+    }
+}
+
+void ResourcesManagerImpl::inflateAsyncRead(std::shared_ptr<AsyncRead> asyncRead, std::shared_ptr<const char> rawData, size_t rawSize, bool shouldCache) {
+    try {
+        const FileRecord& fileRecord = asyncRead->fileRecord;
+        
+        std::shared_ptr<char> contents;
+        void* buffer = asyncRead->buffer;
+        int size = asyncRead->size;
+        if (!buffer) {
+            contents.reset(new char[fileRecord.size + 1], std::default_delete<char[]>());
+            buffer = contents.get();
+            size = (int)fileRecord.size;
+        }
+        
+        size_t bytesRead = inflateRawData(rawData.get(), rawSize, buffer, size);
+        
+        bool cached = false;
+        if (shouldCache && bytesRead == fileRecord.size) {
+            if (!contents) {
+                contents.reset(new char[bytesRead + 1], std::default_delete<char[]>());
+                memcpy(contents.get(), buffer, bytesRead);
+            }
+            cached = contentCache.insert(makeContentKey(fileRecord), contents, bytesRead);
+        }
+        
+        ResourceBlob blob;
+        if (!asyncRead->buffer && !asyncRead->cacheOnly) {
+            blob = ResourceBlob(contents, bytesRead, cached ? CacheBacking : HeapBacking);
+            addSharedBlob(makeContentKey(fileRecord), blob);
+        }
+        finishAsyncRead(asyncRead, blob, bytesRead);
+    }
+    catch (...) {
+        failAsyncRead(asyncRead, std::current_exception());
+    }
+}
+
+void ResourcesManagerImpl::finishAsyncRead(std::shared_ptr<AsyncRead> asyncRead, const ResourceBlob& blob, size_t bytesRead) {
+    if (asyncRead->cacheOnly) return;
+    if (asyncRead->completion) {
+        asyncRead->completion(blob.isValid());
+        return;
+    }
+    if (!asyncRead->buffer) {
+        asyncRead->blobPromise.set_value(blob);
+        return;
+    }
+    
+    // served from memory, the caller still gets its own copy
+    if (blob.isValid()) {
+        bytesRead = std::min<size_t>(asyncRead->size, blob.size());
+        memcpy(asyncRead->buffer, blob.data(), bytesRead);
+    }
+    asyncRead->sizePromise.set_value(bytesRead);
+}
+
+void ResourcesManagerImpl::failAsyncRead(std::shared_ptr<AsyncRead> asyncRead, std::exception_ptr exception) {
+    if (asyncRead->cacheOnly) return;
+    if (asyncRead->completion)
+        asyncRead->completion(false);
+    else if (asyncRead->buffer)
+        asyncRead->sizePromise.set_exception(exception);
+    else
+        asyncRead->blobPromise.set_exception(exception);
+}
+
+void ResourcesManager::enqueueRead(const ReadOptions& options, size_t bytes, const std::function<void()>& task, const std::function<void()>& drop) {
+    pImpl->getIOScheduler().enqueue(options.priority, bytes, options.deadline, options.cancellation, task, drop);
+}
+
+size_t ResourcesManager::getReadBytes(const std::string& filename) {
+    FileRecord fileRecord;
+    if (!pImpl->copyFileRecord(filename, fileRecord)) return 0;
+    
+    return pImpl->getReadBytes(fileRecord);
+}
+
+void ResourcesManager::setInFlightLimit(IOPriority priority, size_t bytes) {
+    pImpl->getIOScheduler().setInFlightLimit(priority, bytes);
+}
+
+size_t ResourcesManager::getInFlightBytes(IOPriority priority) {
+    return pImpl->getIOScheduler().getInFlightBytes(priority);
+}
+
+std::future<size_t> ResourcesManager::readAsync(const std::string& filename, void* buffer, int size,
+                                                const ReadOptions& options /* = ReadOptions() */) {
+    std::shared_ptr<ResourcesManagerImpl::AsyncRead> asyncRead = std::make_shared<ResourcesManagerImpl::AsyncRead>();
+    asyncRead->buffer = buffer;
+    asyncRead->size = size;
+    
+    std::future<size_t> future = asyncRead->sizePromise.get_future();
+    pImpl->startAsyncRead(asyncRead, filename, options);
+    return future;
+}
+
+std::future<ResourceBlob> ResourcesManager::readAsync(const std::string& filename, const ReadOptions& options /* = ReadOptions() */) {
+    std::shared_ptr<ResourcesManagerImpl::AsyncRead> asyncRead = std::make_shared<ResourcesManagerImpl::AsyncRead>();
+    
+    std::future<ResourceBlob> future = asyncRead->blobPromise.get_future();
+    pImpl->startAsyncRead(asyncRead, filename, options);
+    return future;
+}
+
+//
+// batched reads
+//
+
+// Counts down tasks of a batch running on the inflate threads.
+class BatchLatch {
+public:
+    BatchLatch() : pendingCount(0) {}
+    
+    void add() {
+        std::lock_guard<std::mutex> lock(mutex);
+        pendingCount++;
+    }
+    
+    void done(std::exception_ptr exception = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (exception && !firstException)
+            firstException = exception;
+        if (--pendingCount == 0)
+            condition.notify_all();
     }
     
-    return it->second;
-}
+    // rethrows the first exception of a task
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (pendingCount > 0)
+            condition.wait(lock);
+        if (firstException) std::rethrow_exception(firstException);
+    }
+    
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t pendingCount;
+    std::exception_ptr firstException;
+};
 
-void ResourcesManagerImpl::closeSharedZip(const std::string& archivePath) {
-    auto it = sharedZipFiles.find(archivePath);
-    if (it == sharedZipFiles.end()) return;
+// gaps up to this size are read through rather than seeked over
+static const uint64_t batchMaximumGap = 64 * 1024;
+static const uint64_t batchMaximumRunSize = 16 * 1024 * 1024;
+// local header names and extra fields are usually about as long as in the central directory
+static const uint64_t batchLocalHeaderSlack = 30 + 1024;
+
+// Entries served from memory are done first. Archive entries are read per archive in
+// offset order with adjacent ranges merged, and inflated on the inflate threads while
+// the next ranges are read. The rest goes through readShared.
+void ResourcesManagerImpl::readMany(std::vector<BatchEntry>& entries, std::vector<ResourceBlob>& blobs) {
+    std::map<std::string, std::vector<BatchEntry*>> archiveEntries;
+    std::vector<BatchEntry*> unbatchedEntries;
+    
+    for (auto& entry : entries) {
+        const FileRecord& fileRecord = entry.fileRecord;
+        
+        bool batched = (fileRecord.fileType == StoredFile || shouldInflateAsync(fileRecord)) &&
+                       !fileRecord.pinnedContents && !fileRecord.zipEncrypted;
+        if (!batched) {
+            unbatchedEntries.push_back(&entry);
+            continue;
+        }
+        
+        entry.key = makeContentKey(fileRecord);
+        entry.shouldCache = shouldCacheContents(fileRecord);
+        
+        ResourceBlob& blob = blobs[entry.index];
+        blob = findSharedBlob(entry.key);
+        if (blob.isValid()) continue;
+        
+        std::shared_ptr<const char> contents;
+        size_t contentsSize = 0;
+        if (entry.shouldCache && contentCache.lookup(entry.key, contents, contentsSize)) {
+            blob = ResourceBlob(contents, contentsSize, CacheBacking);
+            continue;
+        }
+        
+        archiveEntries[*fileRecord.zipFilePath].push_back(&entry);
+    }
     
-    unzClose(it->second);
-    sharedZipFiles.erase(it);
+    BatchLatch latch;
+    latch.add();
+    try {
+        for (auto& archiveEntriesPair : archiveEntries) {
+            readArchiveBatch(archiveEntriesPair.first, archiveEntriesPair.second, blobs, unbatchedEntries, latch);
+        }
+    }
+    catch (...) {
+        latch.done(std::current_exception());
+        latch.wait();
+    }
+    latch.done();
+    
+    // loose files in path order, they are often laid out that way
+    std::sort(unbatchedEntries.begin(), unbatchedEntries.end(), [](const BatchEntry* a, const BatchEntry* b) {
+        return a->fileRecord.filePath < b->fileRecord.filePath;
+    });
+    for (auto entry : unbatchedEntries) {
+        blobs[entry->index] = readShared(entry->fileRecord);
+    }
+    
+    latch.wait();
 }
 
-void ResourcesManager::addArchive(const std::string& archivePath, const std::string& rootFolder /* = "" */) {
-    unzFile zipFile = pImpl->openSharedZip(archivePath);
-    if (!zipFile) throw std::exception();
-
-    char filePath[1024] = {0};
-    unz_file_info64 fileInfo;
-    int ret = unzGoToFirstFile2(zipFile, &fileInfo, filePath, sizeof(filePath), NULL, 0, NULL, 0);
-    if (ret != UNZ_OK) throw std::exception();
+void ResourcesManagerImpl::readArchiveBatch(const std::string& archivePath, std::vector<BatchEntry*>& entries, std::vector<ResourceBlob>& blobs,
+                                            std::vector<BatchEntry*>& unbatchedEntries, BatchLatch& latch) {
+    std::sort(entries.begin(), entries.end(), [](const BatchEntry* a, const BatchEntry* b) {
+        return a->fileRecord.zipLocalHeaderOffset < b->fileRecord.zipLocalHeaderOffset;
+    });
     
-    do {
-        unz_file_pos zipFilePos;
-        ret = unzGetFilePos(zipFile, &zipFilePos);
-        if (ret != UNZ_OK) throw std::exception();
-                    
-        // skip folders and files outside specified folder
-        bool shouldAddRecord = true;
-        std::string filePathString = filePath;
-        std::string slashEndedRootFolder = rootFolder + '/';
-        if (filePathString[filePathString.size()-1] == '/' ||
-            (!rootFolder.empty() &&
-             filePathString.compare(0, slashEndedRootFolder.size(), slashEndedRootFolder) != 0)) {
-            shouldAddRecord = false; 
+    int fd = open(archivePath.c_str(), O_RDONLY);
+    if (fd < 0) throw std::exception();
+    
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        close(fd);
+        throw std::exception();
+    }
+    uint64_t archiveSize = stat_buf.st_size;
+    
+    size_t runBegin = 0;
+    while (runBegin < entries.size()) {
+        // extend the run while the next entry starts close enough to its end
+        uint64_t runOffset = entries[runBegin]->fileRecord.zipLocalHeaderOffset;
+        uint64_t runEnd = runOffset;
+        size_t runEndIndex = runBegin;
+        while (runEndIndex < entries.size()) {
+            const FileRecord& fileRecord = entries[runEndIndex]->fileRecord;
+            uint64_t entryEnd = std::min(fileRecord.zipLocalHeaderOffset + batchLocalHeaderSlack + fileRecord.zipCompressedSize, archiveSize);
+            if (runEndIndex > runBegin &&
+                (fileRecord.zipLocalHeaderOffset > runEnd + batchMaximumGap || entryEnd - runOffset > batchMaximumRunSize)) break;
+            
+            runEnd = std::max(runEnd, entryEnd);
+            runEndIndex++;
+        }
+        
+        uint64_t runSize = runEnd - runOffset;
+        std::shared_ptr<char> runData(new char[runSize + 1], std::default_delete<char[]>());
+        if (!preadFully(fd, runData.get(), runSize, runOffset)) {
+            close(fd);
+            throw std::exception();
         }
         
-        if (shouldAddRecord) {
+        for (size_t i = runBegin; i < runEndIndex; i++) {
+            BatchEntry* entry = entries[i];
+            const FileRecord& fileRecord = entry->fileRecord;
             
-            std::string rootFolderRelativePath = filePathString;
-            if (!rootFolder.empty()) {
-                rootFolderRelativePath = rootFolderRelativePath.substr(slashEndedRootFolder.size(), rootFolderRelativePath.size() - slashEndedRootFolder.size());
+            uint64_t headerOffset = fileRecord.zipLocalHeaderOffset - runOffset;
+            const unsigned char* header = reinterpret_cast<const unsigned char*>(runData.get()) + headerOffset;
+            bool validHeader = headerOffset + 30 <= runSize && readLE32(header) == 0x04034b50 &&
+                               (fileRecord.fileType != StoredFile || fileRecord.zipCompressedSize == fileRecord.size);
+            uint64_t dataOffset = validHeader ? headerOffset + 30 + readLE16(header + 26) + readLE16(header + 28) : 0;
+            
+            // longer local fields than the slack, or not a local header
+            if (!validHeader || dataOffset + fileRecord.zipCompressedSize > runSize) {
+                unbatchedEntries.push_back(entry);
+                continue;
             }
             
-            FileRecord fileRecord;
-            fileRecord.filename    = filePathString;
-            fileRecord.relativePath= rootFolderRelativePath;
-            fileRecord.fileType    = (fileInfo.compression_method == 0) ? StoredFile : CompressedFile;
-            fileRecord.size        = fileInfo.uncompressed_size;
-            fileRecord.zipFilePath = archivePath;
-            fileRecord.zipFilePos  = zipFilePos;
-            pImpl->fileRecordList.push_back(fileRecord);
-
-            pImpl->shouldRebuildIndex = true;
+            const char* rawData = runData.get() + dataOffset;
+            if (fileRecord.fileType == StoredFile) {
+                std::shared_ptr<char> contents(new char[fileRecord.size + 1], std::default_delete<char[]>());
+                memcpy(contents.get(), rawData, fileRecord.size);
+                blobs[entry->index] = ResourceBlob(contents, fileRecord.size, HeapBacking);
+                addSharedBlob(entry->key, blobs[entry->index]);
+                continue;
+            }
             
+            latch.add();
+            ResourceBlob* blob = &blobs[entry->index];
+            getInflateThreadPool()->enqueue([this, entry, runData, rawData, blob, &latch] {
+                try {
+                    const FileRecord& fileRecord = entry->fileRecord;
+                    std::shared_ptr<char> contents(new char[fileRecord.size + 1], std::default_delete<char[]>());
+                    size_t bytesRead = inflateRawData(rawData, fileRecord.zipCompressedSize, contents.get(), (int)fileRecord.size);
+                    if (bytesRead != fileRecord.size) throw std::exception();
+                    
+                    bool cached = entry->shouldCache && contentCache.insert(entry->key, contents, bytesRead);
+                    *blob = ResourceBlob(contents, bytesRead, cached ? CacheBacking : HeapBacking);
+                    addSharedBlob(entry->key, *blob);
+                    latch.done();
+                }
+                catch (...) {
+                    latch.done(std::current_exception());
+                }
+            });
         }
         
-        ret = unzGoToNextFile2(zipFile, &fileInfo, filePath, sizeof(filePath), NULL, 0, NULL, 0);
-        if (ret == UNZ_END_OF_LIST_OF_FILE) break;
-        if (ret != UNZ_OK) throw std::exception();
-
-    } while (ret != UNZ_END_OF_LIST_OF_FILE);
+        runBegin = runEndIndex;
+    }
+    
+    close(fd);
 }
 
-size_t ResourcesManagerImpl::readDataFromCompressedFile(const FileRecord& fileRecord, void* buffer, int size) {
+size_t ResourcesManager::readMany(const std::vector<std::string>& filenames, std::vector<ResourceBlob>& blobs) {
+    blobs.assign(filenames.size(), ResourceBlob());
+    
+    std::vector<ResourcesManagerImpl::BatchEntry> entries;
+    entries.reserve(filenames.size());
+    for (size_t i = 0; i < filenames.size(); i++) {
+        ResourcesManagerImpl::BatchEntry entry;
+        entry.index = i;
+        entry.shouldCache = false;
+        if (pImpl->copyFileRecord(filenames[i], entry.fileRecord))
+            entries.push_back(entry);
+    }
     
-    unzFile zipFile = openSharedZip(fileRecord.zipFilePath); 
-    if (!zipFile) throw std::exception();
+    pImpl->readMany(entries, blobs);
+    return entries.size();
+}
+
+//
+// prefetch
+//
+
+// asks the kernel to start reading the range into the page cache
+static void adviseWillNeed(int fd, uint64_t offset, uint64_t length) {
+#ifdef __APPLE__
+    struct radvisory advisory;
+    advisory.ra_offset = offset;
+    advisory.ra_count = (int)std::min<uint64_t>(length, INT_MAX);
+    fcntl(fd, F_RDADVISE, &advisory);
+#else
+    posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+// Readahead is requested in storage order, pinned records are already in memory.
+// With inflate, cacheable records are read into the content cache at prefetch priority.
+// by file, archive entries by offset
+static bool isStoredBefore(const FileRecord& a, const FileRecord& b) {
+    const std::string& aPath = a.fileType == RegularFile ? a.filePath : *a.zipFilePath;
+    const std::string& bPath = b.fileType == RegularFile ? b.filePath : *b.zipFilePath;
+    if (aPath != bPath) return aPath < bPath;
+    return a.zipLocalHeaderOffset < b.zipLocalHeaderOffset;
+}
+
+void ResourcesManagerImpl::prefetch(std::vector<FileRecord>& fileRecords, bool inflate) {
+    std::sort(fileRecords.begin(), fileRecords.end(), isStoredBefore);
     
-    unz_file_pos file_pos = fileRecord.zipFilePos;
-    int ret = unzGoToFilePos(zipFile, &file_pos);
-    if (ret != UNZ_OK) throw std::exception();
+    ReadOptions options;
+    options.priority = IOPriorityPrefetch;
     
-    ret = unzOpenCurrentFile(zipFile);
-    if (ret != UNZ_OK) throw std::exception();
+    for (auto& fileRecord : fileRecords) {
+        if (fileRecord.pinnedContents) continue;
+        
+        // the descriptor stays cached for the read that follows
+        const std::string& filePath = fileRecord.fileType == RegularFile ? fileRecord.filePath : *fileRecord.zipFilePath;
+        std::shared_ptr<FileDescriptorCache::Descriptor> descriptor = fileDescriptorCache.acquire(filePath);
+        if (!descriptor) continue;
+        
+        if (fileRecord.fileType == RegularFile)
+            adviseWillNeed(descriptor->get(), 0, fileRecord.size);
+        else
+            adviseWillNeed(descriptor->get(), fileRecord.zipLocalHeaderOffset, batchLocalHeaderSlack + fileRecord.zipCompressedSize);
+        
+        if (inflate && shouldCacheContents(fileRecord)) {
+            std::shared_ptr<AsyncRead> asyncRead = std::make_shared<AsyncRead>();
+            asyncRead->fileRecord = fileRecord;
+            asyncRead->cacheOnly = true;
+            scheduleAsyncRead(asyncRead, options);
+        }
+    }
+}
+
+void ResourcesManager::prefetch(const std::vector<std::string>& filenames, bool inflate /* = false */) {
+    std::vector<FileRecord> fileRecords;
+    fileRecords.reserve(filenames.size());
+    for (auto& filename : filenames) {
+        FileRecord fileRecord;
+        if (pImpl->copyFileRecord(filename, fileRecord))
+            fileRecords.push_back(fileRecord);
+    }
     
-    ret = unzReadCurrentFile(zipFile, buffer, size);
-    if (ret < 0) throw std::exception();
-    return (ret == 0) ? size : ret;
+    pImpl->prefetch(fileRecords, inflate);
 }
 
-void ResourcesManagerImpl::checkZipFileOpened(StreamRecord* streamRecord) {
-    if (!streamRecord->zipFile) {
-        streamRecord->zipFile = unzOpen(streamRecord->fileRecord->zipFilePath.c_str());
-        if (!streamRecord->zipFile) throw std::exception();
+// Records reachable through several keys are prefetched once.
+void ResourcesManager::prefetchCategory(const std::string& category, bool inflate /* = false */) {
+    pImpl->waitForAllMounts();
+    
+    std::vector<FileRecord> fileRecords;
+    {
+        std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
         
-        int ret = unzGoToFilePos(streamRecord->zipFile, &streamRecord->fileRecord->zipFilePos);
-        if (ret != UNZ_OK) throw std::exception();
+        if (pImpl->shouldRebuildIndex)
+            pImpl->rebuildIndex();
         
-        ret = unzOpenCurrentFile(streamRecord->zipFile);
-        if (ret != UNZ_OK) throw std::exception();
+        std::set<FileRecord*> categoryFileRecords;
+        for (auto& keyFileRecordPair : pImpl->fileRecordIndex) {
+            if (keyFileRecordPair.second->category == category)
+                categoryFileRecords.insert(keyFileRecordPair.second);
+        }
+        for (auto fileRecord : categoryFileRecords) {
+            fileRecords.push_back(*fileRecord);
+        }
     }
+    
+    pImpl->prefetch(fileRecords, inflate);
 }
 
 //
-// common methods
+// preload
 //
 
-void ResourcesManagerImpl::traceFileRecord(const std::string& key, const FileRecord& fileRecord) {
-    
-    std::cout << key << ": ";
-    
-    if (!fileRecord.zipFilePath.empty())
-        std::cout << "zip: " << basename(fileRecord.zipFilePath) << ", ";
+static const std::string manifestCategoryPrefix = "category:";
+
+static bool readManifest(const std::string& manifestFile, std::vector<std::string>& names) {
+    std::ifstream manifest(manifestFile.c_str());
+    if (!manifest) return false;
     
-    std::cout << "relative path: " << fileRecord.relativePath << ", ";
+    std::string line;
+    while (std::getline(manifest, line)) {
+        size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string::npos || line[begin] == '#') continue;
         
-    if (!fileRecord.category.empty())
-        std::cout << "category: " << fileRecord.category << ", ";
-    
-    std::cout << "size: " << fileRecord.size << std::endl;
+        size_t end = line.find_last_not_of(" \t\r");
+        names.push_back(line.substr(begin, end - begin + 1));
+    }
+    return !manifest.bad();
 }
 
-std::string ResourcesManagerImpl::makeKey(const std::string& filename) {
-    std::string key = searchByRelativePaths ? filename :  basename(filename);
-    lowercase(key);
-    replaceAll(key, "\\\\", "/");
-    std::replace(key.begin(), key.end(), '\\', '/');
-//    filenameId = removeExtension(filenameId);
+// The mounts pending when the preload starts are waited for on a mount thread, not
+// a read thread. They were queued to the mount threads first, so none waits behind it.
+void ResourcesManagerImpl::startPreload(std::shared_ptr<Preload> preload, const std::string& manifestFile, bool pin) {
+    std::function<void()> task = std::bind(&ResourcesManagerImpl::runPreload, this, preload, manifestFile, pin);
     
-    return key;
+    std::vector<std::shared_future<void>> dependencies = getPendingMounts();
+    if (dependencies.empty()) {
+        getIOScheduler().enqueue(IOPriorityNormal, 0, IOScheduler::noDeadline(), nullptr, task);
+        return;
+    }
+    
+    {
+        // a mount running on the caller's thread is pending without the mount threads
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        if (!mountThreadPool)
+            mountThreadPool.reset(new ThreadPool(ThreadPool::getDefaultThreadsCount()));
+    }
+    
+    mountThreadPool->enqueue([this, dependencies, task]() {
+        for (auto& future : dependencies) {
+            future.wait();
+        }
+        getIOScheduler().enqueue(IOPriorityNormal, 0, IOScheduler::noDeadline(), nullptr, task);
+    });
 }
 
-void ResourcesManagerImpl::rebuildIndex() {
-    fileRecordIndex.clear();
+// Names are resolved once the pending mounts are done, then every record is queued
+// and the last one to finish completes the future.
+void ResourcesManagerImpl::runPreload(std::shared_ptr<Preload> preload, const std::string& manifestFile, bool pin) {
+    std::vector<std::string> names;
+    if (!readManifest(manifestFile, names)) {
+        preload->promise.set_exception(std::make_exception_ptr(std::exception()));
+        return;
+    }
     
-    // prepare lowercase dictionaries
-    decltype(relativeFolderToCategoryMap) lowercaseFolderToCategoryMap;
-    for (auto& folderCategoryPair : relativeFolderToCategoryMap) {
-        std::string relativePath = folderCategoryPair.first;
-        lowercase(relativePath);
+    std::vector<std::shared_ptr<PreloadLoad>> loads;
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
         
-        lowercaseFolderToCategoryMap[relativePath + "/"] = folderCategoryPair.second;
+        if (shouldRebuildIndex)
+            rebuildIndex();
+        
+        std::map<FileRecord*, std::shared_ptr<PreloadLoad>> recordLoads;
+        auto addItem = [&](const std::string& name, FileRecord* fileRecord) {
+            PreloadItem item;
+            item.name = name;
+            item.status = PreloadStatusMissing;
+            preload->items.push_back(item);
+            if (!fileRecord) return;
+            
+            std::shared_ptr<PreloadLoad>& load = recordLoads[fileRecord];
+            if (!load) {
+                load = std::make_shared<PreloadLoad>();
+                load->fileRecord = *fileRecord;
+                load->name = name;
+                loads.push_back(load);
+            }
+            load->itemIndices.push_back(preload->items.size() - 1);
+        };
+        
+        for (auto& name : names) {
+            if (name.compare(0, manifestCategoryPrefix.size(), manifestCategoryPrefix) != 0) {
+                addItem(name, findFileRecord(name));
+                continue;
+            }
+            
+            std::string category = name.substr(manifestCategoryPrefix.size());
+            size_t itemsCount = preload->items.size();
+            for (auto& keyFileRecordPair : fileRecordIndex) {
+                if (keyFileRecordPair.second->category == category)
+                    addItem(keyFileRecordPair.first, keyFileRecordPair.second);
+            }
+            if (preload->items.size() == itemsCount)
+                addItem(name, nullptr);
+        }
     }
     
-    decltype(searchRootsList) lowercaseSearchRootsList;
-    for (auto searchRoot : searchRootsList) {
-        if (searchRoot.empty()) continue;
-        
-        lowercase(searchRoot);
-        replaceAll(searchRoot, "\\\\", "/");
-
-        lowercaseSearchRootsList.push_back(searchRoot + "/");
+    if (loads.empty()) {
+        preload->promise.set_value(preload->items);
+        return;
     }
     
+    std::sort(loads.begin(), loads.end(), [](const std::shared_ptr<PreloadLoad>& a, const std::shared_ptr<PreloadLoad>& b) {
+        return isStoredBefore(a->fileRecord, b->fileRecord);
+    });
+    preload->remainingLoadsCount = loads.size();
     
-    for (auto& fileRecord : fileRecordList) {
-        bool skipRecord = false;
-        std::string relativePathInMap = fileRecord.relativePath;
-        lowercase(relativePathInMap);
-
-        for (auto& folderLanguageIdPair :  relativeFolderToLanguageIdMap) {
-            std::string pathComponentToSearch = folderLanguageIdPair.first + "/";
-            if (relativePathInMap.find(pathComponentToSearch) != std::string::npos)
-            {
-                if (languageId != folderLanguageIdPair.second) {
-                    skipRecord = true;
-                    break;
-                }
-                
-                fileRecord.languageId = folderLanguageIdPair.second;
-                replaceAll(relativePathInMap, pathComponentToSearch, "");
-            }
+    ReadOptions options;
+    options.priority = IOPriorityPrefetch;
+    
+    for (auto& load : loads) {
+        const FileRecord& fileRecord = load->fileRecord;
+        
+        if (pin) {
+            getIOScheduler().enqueue(options.priority, getReadBytes(fileRecord), options.deadline, nullptr,
+                                     std::bind(&ResourcesManagerImpl::pinPreloadLoad, this, preload, load),
+                                     std::bind(&ResourcesManagerImpl::finishPreloadLoad, this, preload, load, PreloadStatusFailed));
         }
-
-        if (skipRecord) continue;
-
-
-        for (auto& folderCategoryPair :  lowercaseFolderToCategoryMap) {
-            if (relativePathInMap.find(folderCategoryPair.first) != std::string::npos)
-            {
-                if (enabledCategories.count(folderCategoryPair.second) == 0) {
-                    skipRecord = true;
-                    break;
-                }
-                
-                fileRecord.category = folderCategoryPair.second;
-                replaceAll(relativePathInMap, folderCategoryPair.first, "");
-            }
+        else if (fileRecord.pinnedContents) {
+            finishPreloadLoad(preload, load, PreloadStatusLoaded);
         }
-        
-        if (skipRecord) continue;
-
-
-        std::string key = makeKey(relativePathInMap);
-        fileRecordIndex[key] = &fileRecord;
+        else if (!shouldCacheContents(fileRecord)) {
+            finishPreloadLoad(preload, load, PreloadStatusSkipped);
+        }
+        else {
+            std::shared_ptr<AsyncRead> asyncRead = std::make_shared<AsyncRead>();
+            asyncRead->fileRecord = fileRecord;
+            asyncRead->completion = [this, preload, load](bool loaded) {
+                finishPreloadLoad(preload, load, loaded ? PreloadStatusLoaded : PreloadStatusFailed);
+            };
+            scheduleAsyncRead(asyncRead, options);
+        }
+    }
+}
 
-        if (enableTrace)
-            traceFileRecord(key, fileRecord);
+void ResourcesManagerImpl::pinPreloadLoad(std::shared_ptr<Preload> preload, std::shared_ptr<PreloadLoad> load) {
+    PreloadStatus status = PreloadStatusFailed;
+    try {
+        switch (pin(load->name, load->fileRecord)) {
+            case PinResultPinned:     status = PreloadStatusLoaded; break;
+            case PinResultMissing:    status = PreloadStatusMissing; break;
+            case PinResultOverBudget: status = PreloadStatusSkipped; break;
+            case PinResultFailed:     status = PreloadStatusFailed; break;
+        }
+    }
+    catch (...) {
+        status = PreloadStatusFailed;
+    }
+    
+    finishPreloadLoad(preload, load, status);
+}
 
+void ResourcesManagerImpl::finishPreloadLoad(std::shared_ptr<Preload> preload, std::shared_ptr<PreloadLoad> load, PreloadStatus status) {
+    {
+        std::lock_guard<std::mutex> lock(preload->itemsMutex);
         
-        for (auto& searchRoot : lowercaseSearchRootsList) {
-            if (searchRoot.empty()) continue;
-            
-            if (relativePathInMap.compare(0, searchRoot.size(), searchRoot) == 0) {
-                
-                std::string searchRootRelativePath = relativePathInMap.substr(searchRoot.size());
-                
-                std::string key = makeKey(searchRootRelativePath);
-                fileRecordIndex[key] = &fileRecord;
-                
-                if (enableTrace)
-                    traceFileRecord(key, fileRecord);
-            }
+        for (size_t itemIndex : load->itemIndices) {
+            preload->items[itemIndex].status = status;
         }
     }
     
-    shouldRebuildIndex = false;
+    if (--preload->remainingLoadsCount == 0)
+        preload->promise.set_value(preload->items);
 }
 
-void ResourcesManager::rebuildIndex() {
-    pImpl->rebuildIndex();
+std::future<std::vector<PreloadItem>> ResourcesManager::preload(const std::string& manifestFile, bool pin /* = false */) {
+    std::shared_ptr<ResourcesManagerImpl::Preload> preload = std::make_shared<ResourcesManagerImpl::Preload>();
+    
+    std::future<std::vector<PreloadItem>> future = preload->promise.get_future();
+    pImpl->startPreload(preload, manifestFile, pin);
+    return future;
 }
 
-FileRecord* ResourcesManagerImpl::findFileRecord(const std::string& filename) {
+//
+// learned prefetch
+//
+
+// Predictions are prefetched before the read itself starts so their I/O overlaps it.
+void ResourcesManagerImpl::recordAccess(const std::string& filename) {
+    std::shared_ptr<AccessPredictor> predictor = std::atomic_load(&accessPredictor);
+    if (!predictor) return;
     
-    if (shouldRebuildIndex) {
-        rebuildIndex();
+    std::vector<std::string> predictedFilenames = predictor->recordAccess(filename);
+    if (predictedFilenames.empty()) return;
+    
+    std::vector<FileRecord> fileRecords;
+    for (auto& predictedFilename : predictedFilenames) {
+        FileRecord fileRecord;
+        if (copyFileRecord(predictedFilename, fileRecord))
+            fileRecords.push_back(fileRecord);
     }
     
-    std::string key = makeKey(filename);
+    prefetch(fileRecords, accessPredictorInflates);
+}
+
+void ResourcesManager::enableAccessPredictor(const std::string& tableFile /* = "" */, bool inflate /* = true */) {
+    std::shared_ptr<AccessPredictor> predictor = std::make_shared<AccessPredictor>();
+    if (!tableFile.empty())
+        predictor->load(tableFile);
     
-    auto it = fileRecordIndex.find(key);
-    if (it == fileRecordIndex.end()) {
-        return nullptr;
-    }
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
     
-    return it->second;
+    pImpl->accessPredictorFile = tableFile;
+    pImpl->accessPredictorInflates = inflate;
+    std::atomic_store(&pImpl->accessPredictor, predictor);
 }
 
-bool ResourcesManager::exists(const std::string& filename) {
-    return (pImpl->findFileRecord(filename) != nullptr);
+void ResourcesManager::disableAccessPredictor() {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    
+    std::atomic_store(&pImpl->accessPredictor, std::shared_ptr<AccessPredictor>());
+    pImpl->accessPredictorFile.clear();
 }
 
-size_t ResourcesManagerImpl::readData(const FileRecord& fileRecord, void* buffer, int size) {
-    if (fileRecord.fileType == RegularFile) {
-        return readDataFromRegularFile(fileRecord.filePath, buffer, size);
-    }
-    else if (fileRecord.fileType == CompressedFile) {
-        return readDataFromCompressedFile(fileRecord, buffer, size);
+bool ResourcesManager::saveAccessPredictor() {
+    std::shared_ptr<AccessPredictor> predictor;
+    std::string tableFile;
+    {
+        std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+        
+        predictor = std::atomic_load(&pImpl->accessPredictor);
+        tableFile = pImpl->accessPredictorFile;
     }
+    if (!predictor || tableFile.empty()) return false;
+    
+    return predictor->save(tableFile);
+}
 
-    return 0;
+AccessPredictorStats ResourcesManager::getAccessPredictorStats() {
+    std::shared_ptr<AccessPredictor> predictor = std::atomic_load(&pImpl->accessPredictor);
+    if (!predictor) return AccessPredictorStats();
+    
+    return predictor->getStats();
 }
 
-size_t ResourcesManager::readData(const std::string& filename, void* buffer, int size) {
+size_t ResourcesManager::getSize(const std::string& filename) {
+    pImpl->waitForMounts(filename);
+
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
     
     FileRecord* fileRecord = pImpl->findFileRecord(filename);
     if (!fileRecord) return 0;
+
+    return fileRecord->size;
+}
+
+ResourceView ResourcesManager::readView(const std::string& filename) {
+    pImpl->waitForMounts(filename);
+    
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
     
-    return pImpl->readData(*fileRecord, buffer, size);
+    FileRecord* fileRecord = pImpl->findFileRecord(filename);
+    if (!fileRecord) return ResourceView();
+    
+    return pImpl->readView(*fileRecord);
 }
 
-std::unique_ptr<char[]> ResourcesManager::readData(const std::string& filename, size_t* pBytesRead) {
+ResourceView ResourcesManager::map(const std::string& filename) {
+    FileRecord fileRecord;
+    if (!pImpl->copyFileRecord(filename, fileRecord)) return ResourceView();
+    pImpl->recordAccess(filename);
+    
+    return pImpl->map(fileRecord);
+}
+
+ResourceBlob ResourcesManager::readShared(const std::string& filename) {
+    FileRecord fileRecord;
+    if (!pImpl->copyFileRecord(filename, fileRecord)) return ResourceBlob();
+    pImpl->recordAccess(filename);
+    
+    return pImpl->readShared(fileRecord);
+}
+
+bool ResourcesManager::pin(const std::string& filename) {
+    FileRecord fileRecord;
+    if (!pImpl->copyFileRecord(filename, fileRecord)) return false;
+    
+    return pImpl->pin(filename, fileRecord) == ResourcesManagerImpl::PinResultPinned;
+}
+
+void ResourcesManager::unpin(const std::string& filename) {
+    pImpl->waitForMounts(filename);
+    
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
     
     FileRecord* fileRecord = pImpl->findFileRecord(filename);
-    if (!fileRecord) {
-        if (pBytesRead)
-            *pBytesRead = 0;
-        return nullptr;
+    if (fileRecord)
+        pImpl->unpin(*fileRecord);
+}
+
+// Records reachable through several keys are pinned once. The records are copied
+// under the lock and read without it.
+bool ResourcesManager::pinCategory(const std::string& category) {
+    pImpl->waitForAllMounts();
+    
+    std::vector<std::pair<std::string, FileRecord>> fileRecords;
+    {
+        std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+        
+        if (pImpl->shouldRebuildIndex)
+            pImpl->rebuildIndex();
+        
+        std::set<FileRecord*> categoryFileRecords;
+        for (auto& keyFileRecordPair : pImpl->fileRecordIndex) {
+            if (keyFileRecordPair.second->category == category &&
+                categoryFileRecords.insert(keyFileRecordPair.second).second)
+                fileRecords.push_back(std::make_pair(keyFileRecordPair.first, *keyFileRecordPair.second));
+        }
     }
     
-    std::unique_ptr<char[]> buffer(new char[fileRecord->size]);
-    size_t bytesRead = pImpl->readData(*fileRecord, buffer.get(), fileRecord->size);
-    if (bytesRead != fileRecord->size) throw std::exception();
+    bool succeeded = true;
+    for (auto& keyFileRecordPair : fileRecords) {
+        succeeded = pImpl->pin(keyFileRecordPair.first, keyFileRecordPair.second) == ResourcesManagerImpl::PinResultPinned && succeeded;
+    }
+    return succeeded;
+}
 
-    if (pBytesRead)
-        *pBytesRead = bytesRead;
+void ResourcesManager::unpinCategory(const std::string& category) {
+    pImpl->waitForAllMounts();
     
-    return buffer;
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    
+    if (pImpl->shouldRebuildIndex)
+        pImpl->rebuildIndex();
+    
+    std::set<FileRecord*> fileRecords;
+    for (auto& keyFileRecordPair : pImpl->fileRecordIndex) {
+        if (keyFileRecordPair.second->category == category)
+            fileRecords.insert(keyFileRecordPair.second);
+    }
+    
+    for (auto fileRecord : fileRecords) {
+        pImpl->unpin(*fileRecord);
+    }
 }
 
-size_t ResourcesManager::getSize(const std::string& filename) {
-    FileRecord* fileRecord = pImpl->findFileRecord(filename);
-    if (!fileRecord) return 0;
+void ResourcesManager::setPinnedBudget(size_t pinnedBudget) {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    pImpl->pinnedBudget = pinnedBudget;
+}
 
-    return fileRecord->size;
+size_t ResourcesManager::getPinnedSize() {
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    return pImpl->pinnedSize;
 }
 
+// The file is opened without the lock, only registering the stream takes it.
 std::unique_ptr<Stream> ResourcesManager::getStream(const std::string& filename) {
+    std::shared_ptr<StreamRecord> streamRecord = std::make_shared<StreamRecord>();
+    if (!pImpl->copyFileRecord(filename, streamRecord->fileRecord)) return nullptr;
     
-    FileRecord* fileRecord = pImpl->findFileRecord(filename);
-    if (!fileRecord) return nullptr;
-    
-    StreamRecord streamRecord;
-    streamRecord.fileRecord = fileRecord;
-    streamRecord.randomValue = arc4random();
-    streamRecord.file = NULL;
-    streamRecord.zipFile = NULL;
+    const FileRecord& fileRecord = streamRecord->fileRecord;
+    streamRecord->file = NULL;
+    streamRecord->zipFile = NULL;
     
-    switch (fileRecord->fileType) {
+    switch (fileRecord.fileType) {
         case RegularFile:
-            streamRecord.file = fopen(fileRecord->filePath.c_str(), "rb");
-            if (!streamRecord.file) return nullptr;
+            streamRecord->file = fopen(fileRecord.filePath.c_str(), "rb");
+            if (!streamRecord->file) return nullptr;
             break;
             
         case CompressedFile:
         case StoredFile:
         {
             // lazy open
+            pImpl->retainSharedZip(*fileRecord.zipFilePath);
             break;
         }
     }
     
-    auto insertResult = pImpl->openStreams.insert(std::make_pair(streamRecord.randomValue, streamRecord));
+    std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+    
+    streamRecord->randomValue = arc4random();
+    auto insertResult = pImpl->openStreams.insert(std::make_pair(streamRecord->randomValue, streamRecord));
     
     if (!insertResult.second) {
+        if (streamRecord->file)
+            fclose(streamRecord->file);
+        else
+            pImpl->releaseSharedZip(*fileRecord.zipFilePath);
         throw std::exception();
     }
     
-    return std::unique_ptr<Stream>(new Stream(reinterpret_cast<int>(streamRecord.randomValue)));
+    return std::unique_ptr<Stream>(new Stream(reinterpret_cast<int>(streamRecord->randomValue)));
 }
 
-StreamRecord* ResourcesManagerImpl::getStreamRecord(int handle) {
+// Only resolving the handle takes the manager lock, the caller locks the stream.
+std::shared_ptr<StreamRecord> ResourcesManagerImpl::getStreamRecord(int handle) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    
     auto it = openStreams.find(handle);
     if (it == openStreams.end()) return nullptr;
     
-    return &it->second;
+    return it->second;
 }
 
 size_t ResourcesManager::readData(int handle, void* buffer, int size) {
-    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
+    std::shared_ptr<StreamRecord> streamRecord = pImpl->getStreamRecord(handle);
     if (!streamRecord) return 0;
     
+    std::lock_guard<std::mutex> streamLock(streamRecord->mutex);
+    
     int ret = 0;
-    switch (streamRecord->fileRecord->fileType) {
+    switch (streamRecord->fileRecord.fileType) {
         case RegularFile:
             ret = fread(buffer, 1, size, streamRecord->file);
             break;
@@ -650,12 +3777,12 @@ size_t ResourcesManager::readData(int handle, void* buffer, int size) {
         case CompressedFile:
         case StoredFile:
         {
-            if (size == streamRecord->fileRecord->size) {
-                return pImpl->readDataFromCompressedFile(*streamRecord->fileRecord, buffer, size);
+            if (size == streamRecord->fileRecord.size) {
+                return pImpl->readDataFromCompressedFile(streamRecord->fileRecord, buffer, size);
             }
             
             // lazy open
-            pImpl->checkZipFileOpened(streamRecord);
+            pImpl->checkZipFileOpened(streamRecord.get());
             
             int unzRet = unzReadCurrentFile(streamRecord->zipFile, buffer, size);
             if (unzRet < 0) throw std::exception();
@@ -666,13 +3793,24 @@ size_t ResourcesManager::readData(int handle, void* buffer, int size) {
     return ret;
 }
 
+// A read in progress finishes before the handles are closed.
 int ResourcesManager::closeFile(int handle) {
-    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
-    if (!streamRecord) return 0;
+    std::shared_ptr<StreamRecord> streamRecord;
+    {
+        std::lock_guard<std::recursive_mutex> lock(pImpl->mutex);
+        
+        auto it = pImpl->openStreams.find(handle);
+        if (it == pImpl->openStreams.end()) return 0;
+        
+        streamRecord = it->second;
+        pImpl->openStreams.erase(it);
+    }
+    
+    std::lock_guard<std::mutex> streamLock(streamRecord->mutex);
     
     int ret = 0;
     
-    switch (streamRecord->fileRecord->fileType) {
+    switch (streamRecord->fileRecord.fileType) {
         case RegularFile:
             if (!streamRecord->file) {
                 break;
@@ -684,6 +3822,8 @@ int ResourcesManager::closeFile(int handle) {
             
         case CompressedFile:
         case StoredFile: {
+            pImpl->releaseSharedZip(*streamRecord->fileRecord.zipFilePath);
+            
             if (!streamRecord->zipFile) {
                 break;
             }
@@ -693,18 +3833,18 @@ int ResourcesManager::closeFile(int handle) {
         }
     }
     
-    pImpl->openStreams.erase(streamRecord->randomValue);
-    
     return ret;
 }
 
 int ResourcesManager::seek (int handle, long int offset, int whence) {
-    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
+    std::shared_ptr<StreamRecord> streamRecord = pImpl->getStreamRecord(handle);
     if (!streamRecord) return 0;
+    
+    std::lock_guard<std::mutex> streamLock(streamRecord->mutex);
 
     int ret = 0;
     
-    switch (streamRecord->fileRecord->fileType) {
+    switch (streamRecord->fileRecord.fileType) {
         case RegularFile:
             ret = fseek(streamRecord->file, offset, whence);
             break;
@@ -712,7 +3852,7 @@ int ResourcesManager::seek (int handle, long int offset, int whence) {
         case CompressedFile:
             throw std::exception();
         case StoredFile: {
-            pImpl->checkZipFileOpened(streamRecord);
+            pImpl->checkZipFileOpened(streamRecord.get());
             
             switch (whence) {
                 case SEEK_SET:
@@ -730,12 +3870,14 @@ int ResourcesManager::seek (int handle, long int offset, int whence) {
 }
 
 long int ResourcesManager::tell(int handle) {
-    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
+    std::shared_ptr<StreamRecord> streamRecord = pImpl->getStreamRecord(handle);
     if (!streamRecord) return 0;
     
+    std::lock_guard<std::mutex> streamLock(streamRecord->mutex);
+    
     int ret = 0;
     
-    switch (streamRecord->fileRecord->fileType) {
+    switch (streamRecord->fileRecord.fileType) {
         case RegularFile:
             ret = ftell(streamRecord->file);
             break;
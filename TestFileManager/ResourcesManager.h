@@ -9,14 +9,175 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <future>
+#include <atomic>
+#include <functional>
+
+#if defined(__has_include)
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+#include <memory_resource>
+#define RESOURCES_MANAGER_MEMORY_RESOURCE 1
+#endif
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define RESOURCES_MANAGER_COROUTINES 1
+#endif
+#endif
+
+#include "ReadArena.h"
+#include "ContentCache.h"
+#include "IOScheduler.h"
+#include "AccessPredictor.h"
 
 class ResourcesManagerImpl;
 class Stream;
+class CoroutineExecutor;
+class ResourceAwaitable;
+class ResourceReadAwaitable;
+class StreamReadAwaitable;
+
+// madvise hint applied to mapped views
+enum MapAdvice {
+    MapAdviceNormal, MapAdviceSequential, MapAdviceRandom, MapAdviceWillNeed
+};
+
+// Read-only bytes of a resource that are not copied out of their backing storage.
+// The view keeps the backing alive, so it stays valid after the resource is unmounted.
+class ResourceView {
+public:
+    ResourceView() : viewData(nullptr), viewSize(0) {}
+    
+    const char* data() const { return viewData; }
+    size_t size() const { return viewSize; }
+    bool isValid() const { return viewData != nullptr; }
+    
+private:
+    friend class ResourcesManagerImpl;
+    
+    ResourceView(const char* data, size_t size, std::shared_ptr<const void> backing)
+        : viewData(data), viewSize(size), backing(backing) {}
+    
+    const char* viewData;
+    size_t viewSize;
+    std::shared_ptr<const void> backing;
+};
+
+// Include/exclude rules applied while a root folder or archive is scanned.
+// Patterns are case insensitive globs: '*' and '?' do not cross '/', '**' does.
+// A pattern without '/' is matched against every path component, a pattern with
+// '/' against the path relative to the mount root. Excluded folders are pruned
+// with everything below them. If any include rule is set, a file has to match one.
+class MountFilter {
+public:
+    MountFilter& include(const std::string& pattern);
+    MountFilter& exclude(const std::string& pattern);
+    MountFilter& includeExtension(const std::string& extension);   // "png" or ".png"
+    MountFilter& excludeExtension(const std::string& extension);
+    
+    bool isEmpty() const;
+    bool matchesFolder(const std::string& relativeFolder) const;
+    bool matchesFile(const std::string& relativePath) const;       // parent folders are not checked
+    bool matchesEntry(const std::string& relativePath) const;      // parent folders and file
+    
+    std::string getSignature() const;
+    
+private:
+    enum PatternKind { LiteralPattern, SuffixPattern, PrefixPattern, GlobPattern };
+    
+    struct Pattern {
+        PatternKind kind;
+        std::string text;       // literal, suffix or prefix text, or the whole glob
+        std::string source;
+    };
+    
+    std::vector<Pattern> includeNamePatterns, includePathPatterns;
+    std::vector<Pattern> excludeNamePatterns, excludePathPatterns;
+    std::set<std::string> includeExtensions, excludeExtensions;
+    
+    static Pattern compilePattern(const std::string& pattern);
+    static bool matchesPattern(const Pattern& pattern, const char* begin, const char* end);
+    static bool matchesAny(const std::vector<Pattern>& patterns, const char* begin, const char* end);
+    bool isExcludedFolder(const std::string& lowercasePath, size_t folderEnd) const;
+    bool matchesLowercaseFile(const std::string& lowercasePath) const;
+};
+
+// Progress of an asynchronous mount, updated from the background thread.
+struct MountProgress {
+    std::atomic<size_t> entriesFound;  // records added so far
+    std::atomic<size_t> bytesParsed;   // central directory bytes parsed, archives only
+    
+    MountProgress() : entriesFound(0), bytesParsed(0) {}
+};
+
+// Where the bytes of a ResourceBlob live.
+enum ResourceBacking {
+    CacheBacking,       // shared with the content cache
+    MappingBacking,     // mapped file or archive
+    HeapBacking,        // buffer of its own
+    PinnedBacking,      // contents of a pinned file
+    SharedMemoryBacking // segment shared with other processes
+};
+
+// Immutable bytes of a resource shared by all holders, released with the last handle.
+class ResourceBlob {
+public:
+    ResourceBlob() : blobSize(0), backing(HeapBacking) {}
+    
+    const char* data() const { return blobData.get(); }
+    size_t size() const { return blobSize; }
+    ResourceBacking getBacking() const { return backing; }
+    bool isValid() const { return blobData != nullptr; }
+    
+private:
+    friend class ResourcesManagerImpl;
+    
+    ResourceBlob(std::shared_ptr<const char> data, size_t size, ResourceBacking backing)
+        : blobData(data), blobSize(size), backing(backing) {}
+    
+    std::shared_ptr<const char> blobData;
+    size_t blobSize;
+    ResourceBacking backing;
+};
+
+// Admission rules of the cache of file contents in front of readData.
+struct ContentCacheOptions {
+    size_t capacity = 16 * 1024 * 1024;     // bytes, 0 disables the cache
+    bool compressedOnly = true;             // only entries that have to be inflated
+    size_t minimumSize = 0;
+    size_t maximumSize = 4 * 1024 * 1024;
+    
+    // Deflated entries the content cache doesn't take are kept compressed
+    // and inflated on every read, 0 disables this tier.
+    size_t compressedCapacity = 16 * 1024 * 1024;
+};
+
+// Scheduling of a queued read.
+struct ReadOptions {
+    IOPriority priority = IOPriorityNormal;
+    IOScheduler::TimePoint deadline = IOScheduler::noDeadline();   // dropped if not started by then
+    std::shared_ptr<const ReadCancellation> cancellation;
+};
+
+enum PreloadStatus {
+    PreloadStatusLoaded,
+    PreloadStatusMissing,     // no such file or category
+    PreloadStatusSkipped,     // not taken by the content cache options or over the pinned budget
+    PreloadStatusFailed
+};
+
+struct PreloadItem {
+    std::string name;         // file of the manifest or of its categories
+    PreloadStatus status;
+};
 
 class ResourcesManager
 {
 public:
     friend class Stream;
+    friend class ResourceAwaitable;
+    friend class ResourceReadAwaitable;
     
     static ResourcesManager* sharedManager();
     
@@ -25,7 +186,24 @@ public:
     void enableTrace(bool enableTrace);
     
     void addRootFolder(const std::string& rootFolder);
-    void addArchive(const std::string& archivePath, const std::string& rootFolder = "");
+    void addRootFolder(const std::string& rootFolder, const MountFilter& filter);
+    // restores the root folder from a saved scan state and rescans only changed folders
+    void addRootFolder(const std::string& rootFolder, const std::string& scanStateFile, const MountFilter& filter = MountFilter());
+    void rescanRootFolder(const std::string& rootFolder);
+    bool saveRootFolderScanState(const std::string& rootFolder, const std::string& scanStateFile);
+    
+    // Unmount, keys shadowed by the removed records become visible again.
+    void removeRootFolder(const std::string& rootFolder);
+    void removeArchive(const std::string& archivePath);
+    void addArchive(const std::string& archivePath, const std::string& rootFolder = "", const MountFilter& filter = MountFilter());
+    
+    // Mount on a background thread. The mount keeps its position in the shadowing order,
+    // lookups wait only for pending mounts that could change their result.
+    std::shared_future<void> addRootFolderAsync(const std::string& rootFolder, std::shared_ptr<MountProgress> progress = nullptr,
+                                                const MountFilter& filter = MountFilter());
+    std::shared_future<void> addArchiveAsync(const std::string& archivePath, const std::string& rootFolder = "",
+                                             std::shared_ptr<MountProgress> progress = nullptr,
+                                             const MountFilter& filter = MountFilter());
     
     void addLanguageFolder(const std::string& languageId, const std::string& languageFolder);
     void addCategoryFolder(const std::string& category, const std::string& categoryFolder);
@@ -39,9 +217,122 @@ public:
     
     bool exists(const std::string& filename);
     size_t getSize(const std::string& filename);
+    // Reads are thread safe and don't block each other, concurrent whole file
+    // reads of the same file share one read and decompression.
     size_t readData(const std::string& filename, void* buffer, int size);
     std::unique_ptr<char[]> readData(const std::string& filename, size_t* bytesRead);
     
+    // Buffers from the caller's allocator, the buffer size is *bytesRead.
+    // Returns nullptr if the file is missing. If the read throws, the buffer is
+    // passed to deallocate when given.
+    typedef std::function<void*(size_t size)> AllocateFunction;
+    typedef std::function<void(void* buffer, size_t size)> DeallocateFunction;
+    char* readData(const std::string& filename, size_t* bytesRead,
+                   const AllocateFunction& allocate, const DeallocateFunction& deallocate = nullptr);
+    // the buffer lives until the arena is reset, see ReadArena::threadArena()
+    char* readData(const std::string& filename, size_t* bytesRead, ReadArena& arena);
+#ifdef RESOURCES_MANAGER_MEMORY_RESOURCE
+    // free with resource->deallocate(buffer, *bytesRead)
+    char* readData(const std::string& filename, size_t* bytesRead, std::pmr::memory_resource* resource);
+#endif
+    
+    // Reads on background threads, the future is ready when the data is. Deflated
+    // entries are inflated on their own threads once their compressed bytes are read,
+    // so many reads in flight keep the device busy. The buffer has to stay valid until then.
+    // Reads are queued by priority and deadline, dropped or cancelled reads complete
+    // with 0 bytes or an invalid blob like missing files.
+    std::future<size_t> readAsync(const std::string& filename, void* buffer, int size, const ReadOptions& options = ReadOptions());
+    std::future<ResourceBlob> readAsync(const std::string& filename, const ReadOptions& options = ReadOptions());
+    
+    // Threads inflating for asynchronous and batched reads, one per core by default (0).
+    // When cpus are given the threads are kept on them, see ThreadPool. Queued inflates
+    // finish on the old threads, which may themselves call this or reset.
+    void setInflateThreads(size_t threadsCount, const std::vector<int>& cpus = std::vector<int>());
+    size_t getInflateThreadsCount();
+    
+    // Bytes a priority class reads at once, see IOScheduler
+    void setInFlightLimit(IOPriority priority, size_t bytes);
+    size_t getInFlightBytes(IOPriority priority);
+    
+    // Reads all files at once, blobs[i] is the contents of filenames[i] or invalid if
+    // it's missing. Archive entries are read in the order they are stored with adjacent
+    // ones merged into large reads, and inflated in parallel. Returns the files found.
+    size_t readMany(const std::vector<std::string>& filenames, std::vector<ResourceBlob>& blobs);
+    
+#ifdef RESOURCES_MANAGER_COROUTINES
+    // co_await read(name) suspends the coroutine during the read, see ResourceAwaitables.h
+    ResourceReadAwaitable read(const std::string& filename, CoroutineExecutor* executor = nullptr,
+                               const ReadOptions& options = ReadOptions());
+#endif
+    
+    // Hints for files needed soon: the kernel starts reading them into the page cache.
+    // With inflate, entries the content cache takes are also inflated into it by
+    // prefetch priority reads. Returns at once, missing files are ignored.
+    void prefetch(const std::vector<std::string>& filenames, bool inflate = false);
+    void prefetchCategory(const std::string& category, bool inflate = false);   // files of an enabled category
+    
+    // Loads the files listed in the manifest into the content cache, or pins them, on the
+    // read threads at prefetch priority. The manifest has a file name or "category:<name>"
+    // per line, empty lines and lines starting with # are skipped. Files are read in the
+    // order they are stored. The future has the status of every file once all are done
+    // and throws if the manifest can't be read.
+    std::future<std::vector<PreloadItem>> preload(const std::string& manifestFile, bool pin = false);
+    
+    // Learns which file is read after which and prefetches the likely next files on
+    // every read, see AccessPredictor. The table is loaded from tableFile if it exists
+    // and saved there by saveAccessPredictor. Disabled by reset.
+    void enableAccessPredictor(const std::string& tableFile = "", bool inflate = true);
+    void disableAccessPredictor();
+    bool saveAccessPredictor();
+    AccessPredictorStats getAccessPredictorStats();
+    
+    // Zero-copy view into the mapped archive, only for files stored without compression.
+    // Returns an invalid view for other files.
+    ResourceView readView(const std::string& filename);
+    
+    // Maps regular files and stored entries, smaller files and compressed entries
+    // are read into a buffer owned by the view. Returns an invalid view if missing.
+    ResourceView map(const std::string& filename);
+    
+    // Readers of the same file share one copy while any of them holds it.
+    // Returns an invalid blob if missing.
+    ResourceBlob readShared(const std::string& filename);
+    
+    // Pinned files are inflated into memory now and read without I/O until unpinned,
+    // outside the content cache and against their own budget (32M by default).
+    // Pins are counted. Returns false if missing, unreadable or over the budget.
+    bool pin(const std::string& filename);
+    void unpin(const std::string& filename);
+    bool pinCategory(const std::string& category);    // files of an enabled category
+    void unpinCategory(const std::string& category);
+    void setPinnedBudget(size_t pinnedBudget);
+    size_t getPinnedSize();
+    void setMapAdvice(MapAdvice mapAdvice);
+    
+    void setContentCacheOptions(const ContentCacheOptions& options);
+    // LRU by default, changing the policy empties the cache
+    void setContentCachePolicy(std::unique_ptr<ContentCachePolicy> policy);
+    ContentCacheStats getContentCacheStats();
+    ContentCacheStats getCompressedCacheStats();
+    
+    // Inflated entries of at least minimumSize are extracted into the folder on
+    // first use and read from there by later reads, runs and other processes.
+    // Files are keyed by archive identity, CRC and size. Empty folder disables.
+    void setDiskCache(const std::string& folder, size_t budget, size_t minimumSize = 64 * 1024);
+    ContentCacheStats getDiskCacheStats();
+    
+    // Inflated entries go into a named shared memory segment that every process
+    // opening the same name and sizes reads without inflating or copying again.
+    // Entries are never evicted. Empty name closes. Returns false if the segment
+    // can't be created or exists with other sizes.
+    bool setSharedMemoryCache(const std::string& name, size_t capacity, size_t maxEntriesCount = 4096);
+    ContentCacheStats getSharedMemoryCacheStats();
+    
+    // Descriptors of recently read regular files are kept open for pread,
+    // 32 by default and at most a quarter of the process limit.
+    void setMaxOpenFiles(size_t maxOpenFiles);
+    void setMinimumMappedSize(size_t minimumMappedSize);    // 64k by default
+    
     std::unique_ptr<Stream> getStream(const std::string& filename);
     
 private:
@@ -53,6 +344,11 @@ private:
     int seek (int handle, long int offset, int whence);
     long int tell(int handle);
     
+    // Runs the task on the read threads as a read of bytes with the options, or drop
+    // instead if it is cancelled or misses its deadline.
+    void enqueueRead(const ReadOptions& options, size_t bytes, const std::function<void()>& task, const std::function<void()>& drop);
+    size_t getReadBytes(const std::string& filename);     // 0 if missing or pinned
+    
     ResourcesManager();
     ResourcesManager(const ResourcesManager &);
     ResourcesManager &operator=(const ResourcesManager &);
@@ -72,6 +368,11 @@ public:
 
     int seek (long int offset, int whence);
     long int tell();
+    
+#ifdef RESOURCES_MANAGER_COROUTINES
+    StreamReadAwaitable read(void* buffer, int size, CoroutineExecutor* executor = nullptr,
+                             const ReadOptions& options = ReadOptions());
+#endif
 
 private:
     Stream();
@@ -0,0 +1,268 @@
+//
+//  SharedMemoryCache.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#include "SharedMemoryCache.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+static const uint32_t segmentMagic = 0x52534d43;     // "RSMC"
+static const uint32_t segmentVersion = 2;
+
+// a process that initializes the header for longer than this died doing it
+static const std::chrono::seconds initializationTimeout(1);
+
+enum SegmentState { UninitializedSegment, InitializingSegment, ReadySegment };
+enum SlotState { EmptySlot, WritingSlot, ReadySlot };
+
+// Lives in the segment, zero filled by ftruncate.
+struct SharedMemoryCache::Header {
+    std::atomic<uint32_t> state;
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint64_t slotsCount;
+    std::atomic<uint64_t> dataSize;         // bump pointer of the data area
+    std::atomic<uint64_t> entriesCount;
+};
+
+// The entry at offset is the key, then the contents at the next 16 byte boundary.
+struct SharedMemoryCache::Slot {
+    std::atomic<uint64_t> hash;             // of the key, 0 is free, hashes are never 0
+    std::atomic<uint32_t> state;
+    uint32_t keyLength;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct SharedMemoryCache::Segment {
+    void* address = nullptr;
+    size_t size = 0;
+    Header* header = nullptr;
+    Slot* slots = nullptr;
+    char* data = nullptr;
+    
+    ~Segment() {
+        if (address)
+            munmap(address, size);
+    }
+};
+
+static size_t alignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+// FNV-1a, stable across processes
+static uint64_t hashKey(const std::string& key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash ? hash : 1;
+}
+
+SharedMemoryCache::SharedMemoryCache() {
+}
+
+SharedMemoryCache::~SharedMemoryCache() {
+    close();
+}
+
+bool SharedMemoryCache::open(const std::string& name, size_t capacity, size_t maxEntriesCount) {
+    close();
+    if (name.empty()) return true;
+    
+    // twice the entries, so probing stays short
+    size_t slotsCount = std::max<size_t>(16, maxEntriesCount * 2);
+    size_t dataOffset = alignUp(sizeof(Header), 64) + alignUp(slotsCount * sizeof(Slot), 64);
+    size_t segmentSize = dataOffset + capacity;
+    
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return false;
+    
+    // every process sizes the segment the same way, ftruncate to the same size is harmless
+    struct stat stat_buf;
+    bool succeeded = fstat(fd, &stat_buf) == 0 &&
+                     ((size_t)stat_buf.st_size == segmentSize || (stat_buf.st_size == 0 && ftruncate(fd, segmentSize) == 0));
+    
+    void* address = succeeded ? mmap(nullptr, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (address == MAP_FAILED) return false;
+    
+    std::shared_ptr<Segment> newSegment = std::make_shared<Segment>();
+    newSegment->address = address;
+    newSegment->size = segmentSize;
+    newSegment->header = static_cast<Header*>(address);
+    newSegment->slots = reinterpret_cast<Slot*>(static_cast<char*>(address) + alignUp(sizeof(Header), 64));
+    newSegment->data = static_cast<char*>(address) + dataOffset;
+    
+    // The first process to get here initializes the header, the others wait for it.
+    // If it dies before it's done, a waiter writes the header itself: every process
+    // writes the same values.
+    Header* header = newSegment->header;
+    uint32_t expectedState = UninitializedSegment;
+    bool initializes = header->state.compare_exchange_strong(expectedState, InitializingSegment);
+    if (!initializes) {
+        auto deadline = std::chrono::steady_clock::now() + initializationTimeout;
+        while (header->state.load(std::memory_order_acquire) != ReadySegment) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                initializes = true;
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+    if (initializes) {
+        header->magic = segmentMagic;
+        header->version = segmentVersion;
+        header->capacity = capacity;
+        header->slotsCount = slotsCount;
+        header->state.store(ReadySegment, std::memory_order_release);
+    }
+    
+    if (header->magic != segmentMagic || header->version != segmentVersion ||
+        header->capacity != capacity || header->slotsCount != slotsCount) return false;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    segment = newSegment;
+    stats = ContentCacheStats();
+    return true;
+}
+
+void SharedMemoryCache::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    // blobs pointing into the segment keep it mapped
+    segment.reset();
+}
+
+bool SharedMemoryCache::isOpen() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return segment != nullptr;
+}
+
+void SharedMemoryCache::remove(const std::string& name) {
+    shm_unlink(name.c_str());
+}
+
+// the segment stays mapped while the caller holds it, even if the cache is closed meanwhile
+std::shared_ptr<SharedMemoryCache::Segment> SharedMemoryCache::getSegment() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return segment;
+}
+
+// Linear probing over the slots. With claim, an empty slot on the way is taken for the hash.
+SharedMemoryCache::Slot* SharedMemoryCache::findSlot(Segment& segment, uint64_t hash, bool claim, bool& claimed) {
+    claimed = false;
+    
+    uint64_t slotsCount = segment.header->slotsCount;
+    for (uint64_t i = 0; i < slotsCount; i++) {
+        Slot* slot = &segment.slots[(hash + i) % slotsCount];
+        uint64_t slotHash = slot->hash.load(std::memory_order_acquire);
+        
+        if (slotHash == hash) return slot;
+        if (slotHash != 0) continue;
+        if (!claim) return nullptr;
+        
+        uint64_t expectedHash = 0;
+        if (slot->hash.compare_exchange_strong(expectedHash, hash)) {
+            claimed = true;
+            return slot;
+        }
+        if (expectedHash == hash) return slot;
+    }
+    return nullptr;
+}
+
+// a slot of another key with the same hash is a miss
+bool SharedMemoryCache::lookup(const std::string& key, size_t size, const char*& data, std::shared_ptr<const void>& backing) {
+    std::shared_ptr<Segment> segment = getSegment();
+    if (!segment) return false;
+    
+    bool claimed = false;
+    Slot* slot = findSlot(*segment, hashKey(key), false, claimed);
+    
+    bool found = slot && slot->state.load(std::memory_order_acquire) == ReadySlot && slot->size == size &&
+                 slot->keyLength == key.size() && memcmp(segment->data + slot->offset, key.data(), key.size()) == 0;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!found) {
+        stats.misses++;
+        return false;
+    }
+    
+    stats.hits++;
+    data = segment->data + slot->offset + alignUp(key.size(), 16);
+    backing = segment;
+    return true;
+}
+
+// The slot and the data are claimed atomically, the contents are copied without a
+// lock and published by the slot state.
+bool SharedMemoryCache::insert(const std::string& key, const void* data, size_t size) {
+    std::shared_ptr<Segment> segment = getSegment();
+    if (!segment) return false;
+    
+    Header* header = segment->header;
+    
+    // another process may be writing the same entry
+    bool claimed = false;
+    Slot* slot = findSlot(*segment, hashKey(key), true, claimed);
+    
+    // the data area never grows past the capacity, so a full segment still takes smaller entries
+    size_t entrySize = alignUp(key.size(), 16) + alignUp(size, 16);
+    uint64_t offset = header->dataSize.load();
+    bool reserved = false;
+    while (claimed && !reserved && offset + entrySize <= header->capacity) {
+        reserved = header->dataSize.compare_exchange_weak(offset, offset + entrySize);
+    }
+    
+    if (!reserved) {
+        // full, the slot is handed back
+        if (claimed)
+            slot->hash.store(0, std::memory_order_release);
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.rejections++;
+        return false;
+    }
+    
+    slot->state.store(WritingSlot, std::memory_order_relaxed);
+    memcpy(segment->data + offset, key.data(), key.size());
+    memcpy(segment->data + offset + alignUp(key.size(), 16), data, size);
+    slot->keyLength = (uint32_t)key.size();
+    slot->offset = offset;
+    slot->size = size;
+    slot->state.store(ReadySlot, std::memory_order_release);
+    
+    header->entriesCount++;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.insertions++;
+    return true;
+}
+
+ContentCacheStats SharedMemoryCache::getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    ContentCacheStats segmentStats = stats;
+    if (segment) {
+        segmentStats.usedBytes = std::min<uint64_t>(segment->header->dataSize.load(), segment->header->capacity);
+        segmentStats.entriesCount = segment->header->entriesCount.load();
+    }
+    return segmentStats;
+}
@@ -0,0 +1,61 @@
+//
+//  SharedMemoryCache.h
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+
+#include "ContentCache.h"
+
+// Cache of inflated entries in a named POSIX shared memory segment, so processes
+// of one host share a single copy. The directory is an open addressing table
+// of slots claimed with compare-and-swap, the data area is filled by an atomic
+// bump pointer, and an entry is published by a release store of its slot state,
+// so neither readers nor writers take a lock. Entries keep their full key next
+// to the contents. Nothing is evicted: once the segment is full, new entries are
+// rejected, readers can hold pointers into the segment for as long as it is open.
+class SharedMemoryCache
+{
+public:
+    SharedMemoryCache();
+    ~SharedMemoryCache();
+    
+    // Creates the segment or attaches to it if another process did, with the
+    // same sizes. Empty name closes the segment.
+    bool open(const std::string& name, size_t capacity, size_t maxEntriesCount);
+    void close();
+    bool isOpen();
+    
+    // the data stays valid while the returned backing is held
+    bool lookup(const std::string& key, size_t size, const char*& data, std::shared_ptr<const void>& backing);
+    bool insert(const std::string& key, const void* data, size_t size);
+    
+    ContentCacheStats getStats();
+    
+    // removes the name, attached processes keep their mapping
+    static void remove(const std::string& name);
+    
+private:
+    struct Header;
+    struct Slot;
+    struct Segment;
+    
+    // guards the segment pointer and the stats only
+    std::shared_ptr<Segment> segment;
+    ContentCacheStats stats;    // of this process, usedBytes and entriesCount of the segment
+    std::mutex mutex;
+    
+    std::shared_ptr<Segment> getSegment();
+    static Slot* findSlot(Segment& segment, uint64_t hash, bool claim, bool& claimed);
+    
+    SharedMemoryCache(const SharedMemoryCache&);
+    SharedMemoryCache &operator=(const SharedMemoryCache&);
+};
@@ -0,0 +1,106 @@
+//
+//  ThreadPool.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#include "ThreadPool.h"
+
+#include <pthread.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+// Darwin has no binding, threads with the same tag are kept on cores sharing a cache
+static void setThreadAffinity(std::thread& thread, int cpu) {
+#if defined(__APPLE__)
+    thread_affinity_policy_data_t policy = { cpu + 1 };
+    thread_policy_set(pthread_mach_thread_np(thread.native_handle()), THREAD_AFFINITY_POLICY,
+                      reinterpret_cast<thread_policy_t>(&policy), THREAD_AFFINITY_POLICY_COUNT);
+#elif defined(__linux__)
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpuSet), &cpuSet);
+#endif
+}
+
+ThreadPool::ThreadPool(size_t threadsCount, const std::vector<int>& cpus /* = std::vector<int>() */) :
+    stopping(false)
+{
+    if (threadsCount == 0) threadsCount = 1;
+    
+    for (size_t i = 0; i < threadsCount; i++) {
+        threads.push_back(std::thread(&ThreadPool::workerLoop, this));
+        if (!cpus.empty())
+            setThreadAffinity(threads.back(), cpus[i % cpus.size()]);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    
+    // pending tasks are still executed before the workers exit
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+static void destroyThreadPool(ThreadPool* threadPool) {
+    if (threadPool->isWorkerThread())
+        std::thread([threadPool] { delete threadPool; }).detach();
+    else
+        delete threadPool;
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::makeShared(size_t threadsCount, const std::vector<int>& cpus /* = std::vector<int>() */) {
+    return std::shared_ptr<ThreadPool>(new ThreadPool(threadsCount, cpus), destroyThreadPool);
+}
+
+void ThreadPool::enqueue(const Task& task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(task);
+    }
+    condition.notify_one();
+}
+
+bool ThreadPool::isWorkerThread() const {
+    std::thread::id threadId = std::this_thread::get_id();
+    for (auto& thread : threads) {
+        if (thread.get_id() == threadId) return true;
+    }
+    return false;
+}
+
+size_t ThreadPool::getDefaultThreadsCount() {
+    size_t threadsCount = std::thread::hardware_concurrency();
+    return threadsCount > 0 ? threadsCount : 1;
+}
+
+void ThreadPool::workerLoop() {
+    for (;;) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping && tasks.empty())
+                condition.wait(lock);
+            
+            if (tasks.empty()) return;
+            
+            task = tasks.front();
+            tasks.pop_front();
+        }
+        
+        task();
+    }
+}
@@ -0,0 +1,55 @@
+//
+//  ThreadPool.h
+//  TestFileManager
+//
+//  Created by Stanislav on 13.12.13.
+//  Copyright (c) 2013 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Fixed size pool of worker threads executing tasks in FIFO order.
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Task;
+    
+    // Worker i runs on cpus[i % cpus.size()] when given, e.g. the cpus of one NUMA node.
+    // Binding on Linux, an affinity tag hint on Darwin, ignored elsewhere.
+    explicit ThreadPool(size_t threadsCount, const std::vector<int>& cpus = std::vector<int>());
+    ~ThreadPool();
+    
+    // A pool whose last owner may be one of its own tasks. A worker can't join itself,
+    // such a pool is destroyed on a thread of its own.
+    static std::shared_ptr<ThreadPool> makeShared(size_t threadsCount, const std::vector<int>& cpus = std::vector<int>());
+    
+    void enqueue(const Task& task);
+    
+    size_t getThreadsCount() const { return threads.size(); }
+    
+    // whether the calling thread is one of the workers
+    bool isWorkerThread() const;
+    
+    // number of hardware threads, at least one
+    static size_t getDefaultThreadsCount();
+    
+private:
+    std::vector<std::thread> threads;
+    std::deque<Task> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping;
+    
+    void workerLoop();
+    
+    ThreadPool(const ThreadPool&);
+    ThreadPool &operator=(const ThreadPool&);
+};
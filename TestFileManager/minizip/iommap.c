@@ -0,0 +1,160 @@
+/* iommap.c -- IO base function header for compress/uncompress .zip
+     Read-only IO backed by a memory mapping of the whole archive
+
+   Reads are a memcpy out of the mapping, seeks only move the position, so
+   minizip's many small header reads do not go through stdio or the kernel.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "iommap.h"
+
+typedef struct
+{
+    const unsigned char *data;
+    ZPOS64_T size;
+    ZPOS64_T position;
+} MMAP_IOSTREAM;
+
+static voidpf   ZCALLBACK mmap_open64_file_func OF((voidpf opaque, const void* filename, int mode));
+static voidpf   ZCALLBACK mmap_opendisk64_file_func OF((voidpf opaque, voidpf stream, int number_disk, int mode));
+static uLong    ZCALLBACK mmap_read_file_func OF((voidpf opaque, voidpf stream, void* buf, uLong size));
+static uLong    ZCALLBACK mmap_write_file_func OF((voidpf opaque, voidpf stream, const void* buf, uLong size));
+static ZPOS64_T ZCALLBACK mmap_tell64_file_func OF((voidpf opaque, voidpf stream));
+static long     ZCALLBACK mmap_seek64_file_func OF((voidpf opaque, voidpf stream, ZPOS64_T offset, int origin));
+static int      ZCALLBACK mmap_close_file_func OF((voidpf opaque, voidpf stream));
+static int      ZCALLBACK mmap_error_file_func OF((voidpf opaque, voidpf stream));
+
+static voidpf ZCALLBACK mmap_open64_file_func (voidpf opaque, const void* filename, int mode)
+{
+    MMAP_IOSTREAM *iostream = NULL;
+    struct stat stat_buf;
+    void *data;
+    int fd;
+
+    if ((filename == NULL) || ((mode & ZLIB_FILEFUNC_MODE_READWRITEFILTER) != ZLIB_FILEFUNC_MODE_READ))
+        return NULL;
+
+    fd = open((const char*)filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if ((fstat(fd, &stat_buf) != 0) || (stat_buf.st_size == 0))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, (size_t)stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    iostream = (MMAP_IOSTREAM*)malloc(sizeof(MMAP_IOSTREAM));
+    if (iostream == NULL)
+    {
+        munmap(data, (size_t)stat_buf.st_size);
+        return NULL;
+    }
+
+    iostream->data = (const unsigned char*)data;
+    iostream->size = (ZPOS64_T)stat_buf.st_size;
+    iostream->position = 0;
+    return iostream;
+}
+
+static voidpf ZCALLBACK mmap_opendisk64_file_func (voidpf opaque, voidpf stream, int number_disk, int mode)
+{
+    return NULL;
+}
+
+static uLong ZCALLBACK mmap_read_file_func (voidpf opaque, voidpf stream, void* buf, uLong size)
+{
+    MMAP_IOSTREAM *iostream = (MMAP_IOSTREAM*)stream;
+    ZPOS64_T available;
+    if (iostream == NULL)
+        return 0;
+
+    available = (iostream->position < iostream->size) ? (iostream->size - iostream->position) : 0;
+    if ((ZPOS64_T)size > available)
+        size = (uLong)available;
+
+    memcpy(buf, iostream->data + iostream->position, (size_t)size);
+    iostream->position += size;
+    return size;
+}
+
+static uLong ZCALLBACK mmap_write_file_func (voidpf opaque, voidpf stream, const void* buf, uLong size)
+{
+    return 0;
+}
+
+static ZPOS64_T ZCALLBACK mmap_tell64_file_func (voidpf opaque, voidpf stream)
+{
+    MMAP_IOSTREAM *iostream = (MMAP_IOSTREAM*)stream;
+    if (iostream == NULL)
+        return (ZPOS64_T)-1;
+    return iostream->position;
+}
+
+static long ZCALLBACK mmap_seek64_file_func (voidpf opaque, voidpf stream, ZPOS64_T offset, int origin)
+{
+    MMAP_IOSTREAM *iostream = (MMAP_IOSTREAM*)stream;
+    ZPOS64_T position;
+    if (iostream == NULL)
+        return -1;
+
+    switch (origin)
+    {
+    case ZLIB_FILEFUNC_SEEK_CUR :
+        position = iostream->position + offset;
+        break;
+    case ZLIB_FILEFUNC_SEEK_END :
+        position = iostream->size + offset;
+        break;
+    case ZLIB_FILEFUNC_SEEK_SET :
+        position = offset;
+        break;
+    default: return -1;
+    }
+
+    if (position > iostream->size)
+        return -1;
+
+    iostream->position = position;
+    return 0;
+}
+
+static int ZCALLBACK mmap_close_file_func (voidpf opaque, voidpf stream)
+{
+    MMAP_IOSTREAM *iostream = (MMAP_IOSTREAM*)stream;
+    if (iostream == NULL)
+        return -1;
+
+    munmap((void*)iostream->data, (size_t)iostream->size);
+    free(iostream);
+    return 0;
+}
+
+static int ZCALLBACK mmap_error_file_func (voidpf opaque, voidpf stream)
+{
+    return 0;
+}
+
+void fill_mmap_filefunc64 (zlib_filefunc64_def* pzlib_filefunc_def)
+{
+    pzlib_filefunc_def->zopen64_file = mmap_open64_file_func;
+    pzlib_filefunc_def->zopendisk64_file = mmap_opendisk64_file_func;
+    pzlib_filefunc_def->zread_file = mmap_read_file_func;
+    pzlib_filefunc_def->zwrite_file = mmap_write_file_func;
+    pzlib_filefunc_def->ztell64_file = mmap_tell64_file_func;
+    pzlib_filefunc_def->zseek64_file = mmap_seek64_file_func;
+    pzlib_filefunc_def->zclose_file = mmap_close_file_func;
+    pzlib_filefunc_def->zerror_file = mmap_error_file_func;
+    pzlib_filefunc_def->opaque = NULL;
+}
@@ -0,0 +1,23 @@
+/* iommap.h -- IO base function header for compress/uncompress .zip
+     Read-only IO backed by a memory mapping of the whole archive
+
+   Same interface as ioapi.h, like iowin32.h. Only ZLIB_FILEFUNC_MODE_READ is
+   supported, spanned archives are not.
+*/
+
+#ifndef _IOMMAP_H
+#define _IOMMAP_H
+
+#include "ioapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void fill_mmap_filefunc64 OF((zlib_filefunc64_def* pzlib_filefunc_def));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,7 +8,13 @@
 
 #import "TestFileManagerTests.h"
 
+#include <thread>
+
 #include "ResourcesManager.h"
+#include "SharedMemoryCache.h"
+#include "IOScheduler.h"
+#include "ThreadPool.h"
+#include "ResourceAwaitables.h"
 
 NSString *BufferToString(const char* buffer, size_t size) {
     if (!buffer) return @"";
@@ -16,6 +22,61 @@ NSString *BufferToString(const char* buffer, size_t size) {
     return [[NSString alloc] initWithBytes:buffer length:size encoding:NSUTF8StringEncoding];
 };
 
+NSString *MakeTemporaryFolder() {
+    NSString *folder = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    [[NSFileManager defaultManager] createDirectoryAtPath:folder withIntermediateDirectories:YES attributes:nil error:nil];
+    return folder;
+}
+
+void WriteStringToFile(NSString *string, NSString *path) {
+    [string writeToFile:path atomically:NO encoding:NSUTF8StringEncoding error:nil];
+}
+
+// Replays half reads of 50 hot entries, half one-off reads of a 20000 entry scan,
+// through a cache that holds 100 entries. Returns the hit ratio.
+double ReplayScanTrace(std::unique_ptr<ContentCachePolicy> policy) {
+    ContentCache cache(100 * 100, std::move(policy));
+    std::shared_ptr<const char> contents(new char[100], std::default_delete<char[]>());
+    
+    unsigned seed = 1;
+    size_t scannedCount = 0;
+    for (int i = 0; i < 100000; i++) {
+        seed = seed * 1103515245 + 12345;
+        std::string key = ((seed >> 16) % 2) ? "hot" + std::to_string((seed >> 8) % 50) : "scan" + std::to_string(scannedCount++ % 20000);
+        
+        std::shared_ptr<const char> data;
+        size_t size = 0;
+        if (!cache.lookup(key, data, size))
+            cache.insert(key, contents, 100);
+    }
+    
+    ContentCacheStats stats = cache.getStats();
+    return double(stats.hits) / (stats.hits + stats.misses);
+}
+
+#ifdef RESOURCES_MANAGER_COROUTINES
+// Coroutine that starts eagerly and is never awaited.
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return DetachedTask(); }
+        std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+DetachedTask ReadTestFile(NSString **contents, size_t *streamBytesRead, std::atomic<bool> *done) {
+    ResourceBlob blob = co_await ResourcesManager::sharedManager()->read("test.txt");
+    *contents = BufferToString(blob.data(), blob.size());
+    
+    auto stream = ResourcesManager::sharedManager()->getStream("test.txt");
+    char buffer[4];
+    *streamBytesRead = co_await stream->read(buffer, sizeof(buffer));
+    *done = true;
+}
+#endif
+
 @implementation TestFileManagerTests
 
 - (void)setUp
@@ -362,4 +423,911 @@ NSString *BufferToString(const char* buffer, size_t size) {
     STAssertEqualObjects(@(buffer), @"es", @"");
 
 }
+
+- (void)testConcurrentStreams
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    
+    // streams read without the manager lock, lookups go on meanwhile
+    std::vector<std::thread> threads;
+    std::atomic<int> succeeded(0);
+    for (int i = 0; i < 4; i++) {
+        threads.push_back(std::thread([&succeeded] {
+            auto stream = ResourcesManager::sharedManager()->getStream("test_compressed.txt");
+            char buffer[5] = {0};
+            if (stream->readData(&buffer, 4) == 4 && std::string(buffer) == "test" &&
+                ResourcesManager::sharedManager()->exists("test_compressed.txt"))
+                succeeded++;
+        }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    STAssertEquals(succeeded.load(), 4, @"");
+}
+
+- (void)testRescanRootFolder
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    NSString *subfolder = [rootFolder stringByAppendingPathComponent:@"sub"];
+    [[NSFileManager defaultManager] createDirectoryAtPath:subfolder withIntermediateDirectories:YES attributes:nil error:nil];
+    WriteStringToFile(@"a", [rootFolder stringByAppendingPathComponent:@"a.txt"]);
+    WriteStringToFile(@"bb", [subfolder stringByAppendingPathComponent:@"b.txt"]);
+    
+    std::string rootFolderPath = [rootFolder UTF8String];
+    std::string scanStateFile = [[rootFolder stringByAppendingPathExtension:@"state"] UTF8String];
+    
+    ResourcesManager::sharedManager()->addRootFolder(rootFolderPath);
+    STAssertTrue(ResourcesManager::sharedManager()->exists("b.txt"), @"");
+    STAssertTrue(ResourcesManager::sharedManager()->saveRootFolderScanState(rootFolderPath, scanStateFile), @"");
+    
+    [[NSFileManager defaultManager] removeItemAtPath:[subfolder stringByAppendingPathComponent:@"b.txt"] error:nil];
+    WriteStringToFile(@"ccc", [subfolder stringByAppendingPathComponent:@"c.txt"]);
+    
+    ResourcesManager::sharedManager()->rescanRootFolder(rootFolderPath);
+    STAssertFalse(ResourcesManager::sharedManager()->exists("b.txt"), @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getSize("c.txt"), (size_t)3, @"");
+    
+    // restart from the saved state
+    ResourcesManager::sharedManager()->reset();
+    ResourcesManager::sharedManager()->addRootFolder(rootFolderPath, scanStateFile);
+    STAssertTrue(ResourcesManager::sharedManager()->exists("a.txt"), @"");
+    STAssertFalse(ResourcesManager::sharedManager()->exists("b.txt"), @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getSize("c.txt"), (size_t)3, @"");
+}
+
+- (void)testRescanRewrittenFile
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    NSString *subfolder = [rootFolder stringByAppendingPathComponent:@"sub"];
+    [[NSFileManager defaultManager] createDirectoryAtPath:subfolder withIntermediateDirectories:YES attributes:nil error:nil];
+    WriteStringToFile(@"hello", [subfolder stringByAppendingPathComponent:@"a.txt"]);
+    
+    std::string rootFolderPath = [rootFolder UTF8String];
+    std::string scanStateFile = [[rootFolder stringByAppendingPathExtension:@"state"] UTF8String];
+    
+    ResourcesManager::sharedManager()->addRootFolder(rootFolderPath);
+    STAssertTrue(ResourcesManager::sharedManager()->saveRootFolderScanState(rootFolderPath, scanStateFile), @"");
+    
+    // rewriting in place keeps the folder mtime
+    ResourcesManager::sharedManager()->reset();
+    WriteStringToFile(@"hello, rewritten!!!", [subfolder stringByAppendingPathComponent:@"a.txt"]);
+    ResourcesManager::sharedManager()->addRootFolder(rootFolderPath, scanStateFile);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("a.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"hello, rewritten!!!", @"");
+    
+    WriteStringToFile(@"bye", [subfolder stringByAppendingPathComponent:@"a.txt"]);
+    ResourcesManager::sharedManager()->rescanRootFolder(rootFolderPath);
+    buffer = ResourcesManager::sharedManager()->readData("a.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"bye", @"");
+}
+
+- (void)testAsyncMounts
+{
+    NSString *rootFolder1 = MakeTemporaryFolder();
+    NSString *rootFolder2 = MakeTemporaryFolder();
+    WriteStringToFile(@"1", [rootFolder1 stringByAppendingPathComponent:@"dup.txt"]);
+    WriteStringToFile(@"22", [rootFolder2 stringByAppendingPathComponent:@"dup.txt"]);
+    
+    auto progress = std::make_shared<MountProgress>();
+    auto future1 = ResourcesManager::sharedManager()->addRootFolderAsync([rootFolder1 UTF8String], progress);
+    auto future2 = ResourcesManager::sharedManager()->addRootFolderAsync([rootFolder2 UTF8String]);
+    auto future3 = ResourcesManager::sharedManager()->addArchiveAsync([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    
+    // later mount wins regardless of completion order
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("dup.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"22", @"");
+    
+    future1.get();
+    STAssertEquals(progress->entriesFound.load(), (size_t)1, @"");
+    
+    char smallBuffer[5] = {0};
+    int size = ResourcesManager::sharedManager()->readData("test_compressed.txt", &smallBuffer, sizeof(smallBuffer));
+    STAssertEquals(size, 4, @"");
+    
+    auto failedFuture = ResourcesManager::sharedManager()->addArchiveAsync("non-existing.zip");
+    STAssertThrows(failedFuture.get(), @"");
+}
+
+- (void)testResetDuringAsyncMounts
+{
+    std::string archivePath = [[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String];
+    
+    // scans of mounts dropped by a reset find no record to commit to
+    std::atomic<bool> stop(false);
+    std::thread mountThread([&stop, &archivePath] {
+        while (!stop) {
+            ResourcesManager::sharedManager()->addArchiveAsync(archivePath);
+        }
+    });
+    for (int i = 0; i < 50; i++) {
+        ResourcesManager::sharedManager()->reset();
+    }
+    stop = true;
+    mountThread.join();
+    
+    ResourcesManager::sharedManager()->reset();
+    ResourcesManager::sharedManager()->addArchiveAsync(archivePath).get();
+    STAssertTrue(ResourcesManager::sharedManager()->exists("test.txt"), @"");
+}
+
+- (void)testMountFilter
+{
+    MountFilter filter;
+    filter.exclude("editor").exclude("src/art/**").excludeExtension("psd").include("textures/*.png").includeExtension("txt");
+    
+    STAssertFalse(filter.matchesFolder("data/Editor"), @"");
+    STAssertFalse(filter.matchesFolder("src/art"), @"");
+    STAssertTrue(filter.matchesFolder("src"), @"");
+    STAssertTrue(filter.matchesFile("textures/a.png"), @"");
+    STAssertFalse(filter.matchesFile("textures/sub/a.png"), @"");
+    STAssertTrue(filter.matchesFile("data/a.TXT"), @"");
+    STAssertFalse(filter.matchesFile("textures/a.psd"), @"");
+    STAssertFalse(filter.matchesEntry("editor/a.txt"), @"");
+}
+
+- (void)testFilteredRootFolder
+{
+    ResourcesManager::sharedManager()->setSearchByRelativePaths(true);
+    ResourcesManager::sharedManager()->addRootFolder([[[NSBundle mainBundle] resourcePath] UTF8String], MountFilter().exclude("localized").excludeExtension("zip"));
+    
+    STAssertTrue(ResourcesManager::sharedManager()->exists("lang_res/file_in_folder.txt"), @"");
+    STAssertFalse(ResourcesManager::sharedManager()->exists("lang_res/localized/ru/file_in_folder.txt"), @"");
+    STAssertFalse(ResourcesManager::sharedManager()->exists("test.zip"), @"");
+}
+
+- (void)testFilteredArchive
+{
+    ResourcesManager::sharedManager()->setSearchByRelativePaths(true);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"category_res" ofType:@"zip"] UTF8String], "category_res", MountFilter().exclude("*-screen"));
+    
+    STAssertTrue(ResourcesManager::sharedManager()->exists("folder/file_in_folder.txt"), @"");
+    STAssertFalse(ResourcesManager::sharedManager()->exists("small-screen/folder/file_in_folder.txt"), @"");
+}
+
+- (void)testRemoveMounts
+{
+    NSString *rootFolder1 = MakeTemporaryFolder();
+    NSString *rootFolder2 = MakeTemporaryFolder();
+    WriteStringToFile(@"1", [rootFolder1 stringByAppendingPathComponent:@"dup.txt"]);
+    WriteStringToFile(@"22", [rootFolder2 stringByAppendingPathComponent:@"dup.txt"]);
+    std::string archivePath = [[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String];
+    
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder1 UTF8String]);
+    ResourcesManager::sharedManager()->addArchive(archivePath);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder2 UTF8String]);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("dup.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"22", @"");
+    
+    // shadowed key becomes visible again
+    ResourcesManager::sharedManager()->removeRootFolder([rootFolder2 UTF8String]);
+    buffer = ResourcesManager::sharedManager()->readData("dup.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"1", @"");
+    
+    // open streams survive the removal of their archive
+    auto stream = ResourcesManager::sharedManager()->getStream("test.txt");
+    ResourcesManager::sharedManager()->removeArchive(archivePath);
+    STAssertFalse(ResourcesManager::sharedManager()->exists("test.txt"), @"");
+    
+    char smallBuffer[5] = {0};
+    int size = stream->readData(&smallBuffer, 4);
+    STAssertEquals(size, 4, @"");
+    STAssertEqualObjects(@(smallBuffer), @"test", @"");
+}
+
+- (void)testPrefixedArchive
+{
+    NSString *folder = MakeTemporaryFolder();
+    NSString *archivePath = [folder stringByAppendingPathComponent:@"prefixed.zip"];
+    NSString *brokenPath = [folder stringByAppendingPathComponent:@"broken.zip"];
+    
+    // self-extractor style stub in front of the archive
+    NSMutableData *data = [[@"#!/bin/sh\nexit 0\n" dataUsingEncoding:NSUTF8StringEncoding] mutableCopy];
+    [data appendData:[NSData dataWithContentsOfFile:[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"]]];
+    [data writeToFile:archivePath atomically:NO];
+    WriteStringToFile(@"not an archive", brokenPath);
+    
+    ResourcesManager::sharedManager()->addArchive([archivePath UTF8String]);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    STAssertTrue([BufferToString(buffer.get(), bytesRead) hasPrefix:@"test"], @"");
+    
+    STAssertThrows(ResourcesManager::sharedManager()->addArchive([brokenPath UTF8String]), @"");
+    STAssertTrue(ResourcesManager::sharedManager()->exists("test.txt"), @"");
+}
+
+- (void)testStoredFileView
+{
+    std::string storedArchivePath = [[[NSBundle mainBundle] pathForResource:@"test_stored" ofType:@"zip"] UTF8String];
+    ResourcesManager::sharedManager()->addArchive(storedArchivePath);
+    
+    ResourceView view = ResourcesManager::sharedManager()->readView("test.txt");
+    STAssertTrue(view.isValid(), @"");
+    STAssertEqualObjects(BufferToString(view.data(), view.size()), @"test", @"");
+    
+    // the view keeps the mapping after the archive is removed
+    ResourcesManager::sharedManager()->removeArchive(storedArchivePath);
+    STAssertEqualObjects(BufferToString(view.data(), view.size()), @"test", @"");
+    
+    // compressed files have no view
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    STAssertFalse(ResourcesManager::sharedManager()->readView("test.txt").isValid(), @"");
+}
+
+- (void)testMapFile
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    NSString *largeString = [@"" stringByPaddingToLength:200000 withString:@"large" startingAtIndex:0];
+    WriteStringToFile(largeString, [rootFolder stringByAppendingPathComponent:@"large.txt"]);
+    WriteStringToFile(@"small", [rootFolder stringByAppendingPathComponent:@"small.txt"]);
+    
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    ResourcesManager::sharedManager()->setMapAdvice(MapAdviceSequential);
+    
+    ResourceView largeView = ResourcesManager::sharedManager()->map("large.txt");
+    STAssertEquals(largeView.size(), (size_t)200000, @"");
+    STAssertEqualObjects(BufferToString(largeView.data(), largeView.size()), largeString, @"");
+    
+    // read below the threshold
+    ResourceView smallView = ResourcesManager::sharedManager()->map("small.txt");
+    STAssertEqualObjects(BufferToString(smallView.data(), smallView.size()), @"small", @"");
+    
+    STAssertFalse(ResourcesManager::sharedManager()->map("missing.txt").isValid(), @"");
+}
+
+- (void)testCachedFileDescriptors
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    for (int i = 0; i < 4; i++) {
+        WriteStringToFile([NSString stringWithFormat:@"file%d", i], [rootFolder stringByAppendingPathComponent:[NSString stringWithFormat:@"file%d.txt", i]]);
+    }
+    
+    ResourcesManager::sharedManager()->setMaxOpenFiles(2);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    
+    // more files than cached descriptors
+    char buffer[16];
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 4; i++) {
+            size_t bytesRead = ResourcesManager::sharedManager()->readData([[NSString stringWithFormat:@"file%d.txt", i] UTF8String], buffer, sizeof(buffer));
+            STAssertEqualObjects(BufferToString(buffer, bytesRead), ([NSString stringWithFormat:@"file%d", i]), @"");
+        }
+    }
+    
+    // a file replaced by a rename is reopened after the rescan
+    NSString *tempFile = [rootFolder stringByAppendingPathComponent:@"file.tmp"];
+    WriteStringToFile(@"replaced", tempFile);
+    rename([tempFile UTF8String], [[rootFolder stringByAppendingPathComponent:@"file0.txt"] UTF8String]);
+    ResourcesManager::sharedManager()->rescanRootFolder([rootFolder UTF8String]);
+    
+    size_t bytesRead = ResourcesManager::sharedManager()->readData("file0.txt", buffer, sizeof(buffer));
+    STAssertEqualObjects(BufferToString(buffer, bytesRead), @"replaced", @"");
+}
+
+- (void)testReadDataIntoArena
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    ReadArena& arena = ReadArena::threadArena();
+    arena.reset();
+    
+    size_t bytesRead = 0;
+    char* buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead, arena);
+    STAssertTrue([BufferToString(buffer, bytesRead) hasPrefix:@"test"], @"");
+    STAssertEquals(arena.getAllocatedSize(), bytesRead, @"");
+    
+    // reset hands the same memory out again
+    arena.reset();
+    STAssertEquals(ResourcesManager::sharedManager()->readData("test.txt", &bytesRead, arena), buffer, @"");
+    
+    buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead, [](size_t size) {
+        return malloc(size);
+    });
+    STAssertTrue([BufferToString(buffer, bytesRead) hasPrefix:@"test"], @"");
+    free(buffer);
+}
+
+- (void)testContentCache
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    auto cachedBuffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(cachedBuffer.get(), bytesRead), BufferToString(buffer.get(), bytesRead), @"");
+    
+    ContentCacheStats stats = ResourcesManager::sharedManager()->getContentCacheStats();
+    STAssertEquals(stats.misses, (size_t)1, @"");
+    STAssertEquals(stats.hits, (size_t)1, @"");
+    STAssertEquals(stats.usedBytes, bytesRead, @"");
+    
+    // a budget smaller than the file admits nothing
+    ContentCacheOptions options;
+    options.capacity = 2;
+    ResourcesManager::sharedManager()->setContentCacheOptions(options);
+    STAssertEquals(ResourcesManager::sharedManager()->getContentCacheStats().entriesCount, (size_t)0, @"");
+}
+
+- (void)testTinyLFUHitRatio
+{
+    double lruHitRatio = ReplayScanTrace(nullptr);
+    double tinyLFUHitRatio = ReplayScanTrace(std::unique_ptr<ContentCachePolicy>(new TinyLFUContentCachePolicy(100)));
+    NSLog(@"scan trace hit ratio: LRU %.3f, W-TinyLFU %.3f", lruHitRatio, tinyLFUHitRatio);
+    
+    // the hot half of the reads stays cached
+    STAssertTrue(tinyLFUHitRatio > 0.45, @"");
+    STAssertTrue(tinyLFUHitRatio > lruHitRatio, @"");
+}
+
+- (void)testReadShared
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    WriteStringToFile(@"small", [rootFolder stringByAppendingPathComponent:@"small.txt"]);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    // one copy for all readers
+    ResourceBlob blob = ResourcesManager::sharedManager()->readShared("small.txt");
+    ResourceBlob otherBlob = ResourcesManager::sharedManager()->readShared("small.txt");
+    STAssertEquals(blob.data(), otherBlob.data(), @"");
+    STAssertEquals(blob.getBacking(), HeapBacking, @"");
+    STAssertEqualObjects(BufferToString(blob.data(), blob.size()), @"small", @"");
+    
+    ResourceBlob compressedBlob = ResourcesManager::sharedManager()->readShared("test.txt");
+    STAssertEquals(compressedBlob.getBacking(), CacheBacking, @"");
+    STAssertTrue([BufferToString(compressedBlob.data(), compressedBlob.size()) hasPrefix:@"test"], @"");
+    
+    STAssertFalse(ResourcesManager::sharedManager()->readShared("missing.txt").isValid(), @"");
+}
+
+- (void)testPinning
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    NSString *fontPath = [rootFolder stringByAppendingPathComponent:@"font.ttf"];
+    WriteStringToFile(@"glyphs", fontPath);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    
+    STAssertTrue(ResourcesManager::sharedManager()->pin("font.ttf"), @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getPinnedSize(), (size_t)6, @"");
+    
+    // served from memory
+    [[NSFileManager defaultManager] removeItemAtPath:fontPath error:nil];
+    char buffer[16];
+    size_t bytesRead = ResourcesManager::sharedManager()->readData("font.ttf", buffer, sizeof(buffer));
+    STAssertEqualObjects(BufferToString(buffer, bytesRead), @"glyphs", @"");
+    
+    ResourcesManager::sharedManager()->unpin("font.ttf");
+    STAssertEquals(ResourcesManager::sharedManager()->getPinnedSize(), (size_t)0, @"");
+    
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->setPinnedBudget(2);
+    STAssertFalse(ResourcesManager::sharedManager()->pin("test.txt"), @"");
+}
+
+- (void)testPinnedReload
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    NSString *filePath = [rootFolder stringByAppendingPathComponent:@"pinned.txt"];
+    WriteStringToFile(@"one", filePath);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    STAssertTrue(ResourcesManager::sharedManager()->pin("pinned.txt"), @"");
+    
+    // a rewritten file stays pinned with its new contents
+    WriteStringToFile(@"three", filePath);
+    ResourcesManager::sharedManager()->rescanRootFolder([rootFolder UTF8String]);
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("pinned.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"three", @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getPinnedSize(), (size_t)5, @"");
+    
+    // and is unpinned once it no longer fits the budget
+    ResourcesManager::sharedManager()->setPinnedBudget(4);
+    WriteStringToFile(@"eleven", filePath);
+    ResourcesManager::sharedManager()->rescanRootFolder([rootFolder UTF8String]);
+    STAssertEquals(ResourcesManager::sharedManager()->getPinnedSize(), (size_t)0, @"");
+    buffer = ResourcesManager::sharedManager()->readData("pinned.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"eleven", @"");
+}
+
+- (void)testPinnedSiblings
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    NSString *filePath = [rootFolder stringByAppendingPathComponent:@"a.txt"];
+    WriteStringToFile(@"aaa", filePath);
+    WriteStringToFile(@"bakbak", [rootFolder stringByAppendingPathComponent:@"a.txt.bak"]);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    STAssertTrue(ResourcesManager::sharedManager()->pin("a.txt"), @"");
+    STAssertTrue(ResourcesManager::sharedManager()->pin("a.txt.bak"), @"");
+    
+    // dropping a.txt leaves the pin of a.txt.bak alone
+    [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
+    ResourcesManager::sharedManager()->rescanRootFolder([rootFolder UTF8String]);
+    STAssertEquals(ResourcesManager::sharedManager()->getPinnedSize(), (size_t)6, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->readShared("a.txt.bak").getBacking(), PinnedBacking, @"");
+    
+    ResourcesManager::sharedManager()->unpin("a.txt.bak");
+    STAssertEquals(ResourcesManager::sharedManager()->getPinnedSize(), (size_t)0, @"");
+}
+
+- (void)testRemoveRootAboveNestedRoot
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    NSString *nestedFolder = [rootFolder stringByAppendingPathComponent:@"sub"];
+    [[NSFileManager defaultManager] createDirectoryAtPath:nestedFolder withIntermediateDirectories:YES attributes:nil error:nil];
+    WriteStringToFile(@"yy", [nestedFolder stringByAppendingPathComponent:@"y.txt"]);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    ResourcesManager::sharedManager()->addRootFolder([nestedFolder UTF8String]);
+    STAssertTrue(ResourcesManager::sharedManager()->pin("y.txt"), @"");
+    
+    // the nested root stays mounted and keeps its pin
+    ResourcesManager::sharedManager()->removeRootFolder([rootFolder UTF8String]);
+    STAssertEquals(ResourcesManager::sharedManager()->getPinnedSize(), (size_t)2, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->readShared("y.txt").getBacking(), PinnedBacking, @"");
+    
+    ResourcesManager::sharedManager()->unpin("y.txt");
+    STAssertEquals(ResourcesManager::sharedManager()->getPinnedSize(), (size_t)0, @"");
+}
+
+- (void)testCompressedCache
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    NSString *contents = BufferToString(buffer.get(), bytesRead);
+    
+    // entries the content cache doesn't take stay compressed in memory
+    ContentCacheOptions options;
+    options.capacity = 0;
+    ResourcesManager::sharedManager()->setContentCacheOptions(options);
+    
+    for (int i = 0; i < 2; i++) {
+        buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+        STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), contents, @"");
+    }
+    
+    ContentCacheStats stats = ResourcesManager::sharedManager()->getCompressedCacheStats();
+    STAssertEquals(stats.misses, (size_t)1, @"");
+    STAssertEquals(stats.hits, (size_t)1, @"");
+}
+
+- (void)testDiskCache
+{
+    std::string cacheFolder = [[MakeTemporaryFolder() stringByAppendingPathComponent:@"cache"] UTF8String];
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    ContentCacheOptions options;
+    options.capacity = 0;
+    options.compressedCapacity = 0;
+    ResourcesManager::sharedManager()->setContentCacheOptions(options);
+    ResourcesManager::sharedManager()->setDiskCache(cacheFolder, 1024 * 1024, 0);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    NSString *contents = BufferToString(buffer.get(), bytesRead);
+    STAssertEquals(ResourcesManager::sharedManager()->getDiskCacheStats().insertions, (size_t)1, @"");
+    
+    // as in a later run, the extracted file is found in the folder
+    ResourcesManager::sharedManager()->setDiskCache(cacheFolder, 1024 * 1024, 0);
+    STAssertEquals(ResourcesManager::sharedManager()->getDiskCacheStats().entriesCount, (size_t)1, @"");
+    
+    buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), contents, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getDiskCacheStats().hits, (size_t)1, @"");
+}
+
+- (void)testDiskCacheCorruptFile
+{
+    NSString *cacheFolder = [MakeTemporaryFolder() stringByAppendingPathComponent:@"cache"];
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    ContentCacheOptions options;
+    options.capacity = 0;
+    options.compressedCapacity = 0;
+    ResourcesManager::sharedManager()->setContentCacheOptions(options);
+    ResourcesManager::sharedManager()->setDiskCache([cacheFolder UTF8String], 1024 * 1024, 0);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    NSString *contents = BufferToString(buffer.get(), bytesRead);
+    
+    // the extracted file keeps its size but not its contents
+    NSString *cachedFile = [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:cacheFolder error:nil] lastObject];
+    NSString *cachedPath = [cacheFolder stringByAppendingPathComponent:cachedFile];
+    WriteStringToFile([@"" stringByPaddingToLength:bytesRead withString:@"X" startingAtIndex:0], cachedPath);
+    
+    // a later run doesn't serve it
+    ResourcesManager::sharedManager()->setDiskCache([cacheFolder UTF8String], 1024 * 1024, 0);
+    buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), contents, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getDiskCacheStats().hits, (size_t)0, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getDiskCacheStats().entriesCount, (size_t)1, @"");
+}
+
+- (void)testDiskCacheForeignFiles
+{
+    NSString *cacheFolder = MakeTemporaryFolder();
+    NSString *notesPath = [cacheFolder stringByAppendingPathComponent:@"notes.txt"];
+    NSString *staleTempPath = [cacheFolder stringByAppendingPathComponent:@"0123456789abcdef-01234567-4-99-0.tmp"];
+    NSString *freshTempPath = [cacheFolder stringByAppendingPathComponent:@"0123456789abcdef-01234567-4-99-1.tmp"];
+    WriteStringToFile(@"keep me", notesPath);
+    WriteStringToFile(@"part", staleTempPath);
+    WriteStringToFile(@"part", freshTempPath);
+    [[NSFileManager defaultManager] setAttributes:@{NSFileModificationDate: [NSDate dateWithTimeIntervalSinceNow:-2 * 60 * 60]}
+                                     ofItemAtPath:staleTempPath error:nil];
+    
+    // only files named like extracted files are evicted, temporary ones once stale
+    ResourcesManager::sharedManager()->setDiskCache([cacheFolder UTF8String], 1, 0);
+    STAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:notesPath], @"");
+    STAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:staleTempPath], @"");
+    STAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:freshTempPath], @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getDiskCacheStats().entriesCount, (size_t)0, @"");
+}
+
+- (void)testSharedMemoryCache
+{
+    std::string name = [[NSString stringWithFormat:@"/rmtest%d", getpid()] UTF8String];
+    SharedMemoryCache::remove(name);
+    
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    ContentCacheOptions options;
+    options.capacity = 0;
+    options.compressedCapacity = 0;
+    ResourcesManager::sharedManager()->setContentCacheOptions(options);
+    STAssertTrue(ResourcesManager::sharedManager()->setSharedMemoryCache(name, 1024 * 1024, 64), @"");
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    STAssertEquals(ResourcesManager::sharedManager()->getSharedMemoryCacheStats().insertions, (size_t)1, @"");
+    
+    // as seen by another process
+    SharedMemoryCache otherCache;
+    STAssertTrue(otherCache.open(name, 1024 * 1024, 64), @"");
+    STAssertEquals(otherCache.getStats().entriesCount, (size_t)1, @"");
+    
+    ResourceBlob blob = ResourcesManager::sharedManager()->readShared("test.txt");
+    STAssertEquals(blob.getBacking(), SharedMemoryBacking, @"");
+    STAssertEqualObjects(BufferToString(blob.data(), blob.size()), BufferToString(buffer.get(), bytesRead), @"");
+    
+    SharedMemoryCache::remove(name);
+}
+
+- (void)testSharedMemoryCacheFull
+{
+    std::string name = [[NSString stringWithFormat:@"/rmfull%d", getpid()] UTF8String];
+    SharedMemoryCache::remove(name);
+    
+    SharedMemoryCache cache;
+    STAssertTrue(cache.open(name, 256, 4), @"");
+    std::string large(200, 'l'), small(16, 's');
+    STAssertTrue(cache.insert("large", large.data(), large.size()), @"");
+    STAssertFalse(cache.insert("other", large.data(), large.size()), @"");
+    
+    // a rejected entry doesn't keep its slot, smaller entries still fit
+    STAssertTrue(cache.insert("small", small.data(), small.size()), @"");
+    const char* data = nullptr;
+    std::shared_ptr<const void> backing;
+    STAssertTrue(cache.lookup("small", small.size(), data, backing), @"");
+    STAssertTrue(std::string(data, small.size()) == small, @"");
+    STAssertFalse(cache.lookup("other", large.size(), data, backing), @"");
+    
+    SharedMemoryCache::remove(name);
+}
+
+- (void)testCoalescedReads
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    NSString *contents = BufferToString(buffer.get(), bytesRead);
+    
+    ContentCacheOptions options;
+    options.capacity = 0;
+    ResourcesManager::sharedManager()->setContentCacheOptions(options);
+    size_t insertionsCount = ResourcesManager::sharedManager()->getCompressedCacheStats().insertions;
+    
+    // readers of the same entry share one read
+    std::vector<ResourceBlob> blobs(8);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < blobs.size(); i++) {
+        threads.push_back(std::thread([&blobs, i] {
+            blobs[i] = ResourcesManager::sharedManager()->readShared("test.txt");
+        }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    
+    for (auto& blob : blobs) {
+        STAssertEqualObjects(BufferToString(blob.data(), blob.size()), contents, @"");
+        STAssertEquals(blob.data(), blobs[0].data(), @"");
+    }
+    STAssertEquals(ResourcesManager::sharedManager()->getCompressedCacheStats().insertions, insertionsCount + 1, @"");
+}
+
+- (void)testShortReadNotShared
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    NSString *path = [rootFolder stringByAppendingPathComponent:@"file.txt"];
+    NSString *contents = [@"" stringByPaddingToLength:100000 withString:@"x" startingAtIndex:0];
+    WriteStringToFile(contents, path);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    
+    // a read cut short by the file shrinking is not handed to later readers
+    WriteStringToFile(@"short", path);
+    ResourceBlob shortBlob = ResourcesManager::sharedManager()->readShared("file.txt");
+    STAssertTrue(shortBlob.size() != [contents length], @"");
+    
+    WriteStringToFile(contents, path);
+    ResourceBlob blob = ResourcesManager::sharedManager()->readShared("file.txt");
+    STAssertEquals(blob.size(), (size_t)[contents length], @"");
+}
+
+- (void)testReadAsync
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    WriteStringToFile(@"loose", [rootFolder stringByAppendingPathComponent:@"loose.txt"]);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    NSString *contents = BufferToString(buffer.get(), bytesRead);
+    
+    std::vector<std::future<ResourceBlob>> futures;
+    for (int i = 0; i < 8; i++) {
+        futures.push_back(ResourcesManager::sharedManager()->readAsync("test.txt"));
+    }
+    for (auto& future : futures) {
+        ResourceBlob blob = future.get();
+        STAssertEqualObjects(BufferToString(blob.data(), blob.size()), contents, @"");
+    }
+    
+    char looseBuffer[8];
+    size_t looseBytesRead = ResourcesManager::sharedManager()->readAsync("loose.txt", looseBuffer, sizeof(looseBuffer)).get();
+    STAssertEqualObjects(BufferToString(looseBuffer, looseBytesRead), @"loose", @"");
+    
+    STAssertFalse(ResourcesManager::sharedManager()->readAsync("missing.txt").get().isValid(), @"");
+}
+
+- (void)testReadMany
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    WriteStringToFile(@"loose", [rootFolder stringByAppendingPathComponent:@"loose.txt"]);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"res" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    std::vector<std::string> filenames = {"test.txt", "missing.txt", "loose.txt", "file_in_folder.txt"};
+    std::vector<ResourceBlob> blobs;
+    STAssertEquals(ResourcesManager::sharedManager()->readMany(filenames, blobs), (size_t)3, @"");
+    STAssertEquals(blobs.size(), filenames.size(), @"");
+    STAssertFalse(blobs[1].isValid(), @"");
+    STAssertEqualObjects(BufferToString(blobs[2].data(), blobs[2].size()), @"loose", @"");
+    
+    for (size_t i : {0, 3}) {
+        size_t bytesRead = 0;
+        auto buffer = ResourcesManager::sharedManager()->readData(filenames[i], &bytesRead);
+        STAssertEqualObjects(BufferToString(blobs[i].data(), blobs[i].size()), BufferToString(buffer.get(), bytesRead), @"");
+    }
+}
+
+
+- (void)testIOScheduler
+{
+    std::vector<int> order;
+    std::mutex orderMutex;
+    auto record = [&order, &orderMutex](int value) {
+        return [&order, &orderMutex, value] {
+            std::lock_guard<std::mutex> lock(orderMutex);
+            order.push_back(value);
+        };
+    };
+    
+    {
+        IOScheduler scheduler(1);
+        
+        // holds the only worker until everything is queued
+        std::promise<void> gate;
+        std::shared_future<void> gateFuture = gate.get_future().share();
+        scheduler.enqueue(IOPriorityNormal, 0, IOScheduler::noDeadline(), nullptr, [gateFuture] { gateFuture.wait(); });
+        while (scheduler.getQueuedCount(IOPriorityNormal) > 0) {
+            std::this_thread::yield();
+        }
+        
+        auto now = std::chrono::steady_clock::now();
+        std::shared_ptr<ReadCancellation> cancellation = std::make_shared<ReadCancellation>();
+        scheduler.enqueue(IOPriorityPrefetch, 1, IOScheduler::noDeadline(), nullptr, record(4));
+        scheduler.enqueue(IOPriorityNormal, 1, IOScheduler::noDeadline(), nullptr, record(3));
+        scheduler.enqueue(IOPriorityNormal, 1, IOScheduler::noDeadline(), cancellation, record(-1), record(0));
+        scheduler.enqueue(IOPriorityUrgent, 1, now + std::chrono::hours(2), nullptr, record(2));
+        scheduler.enqueue(IOPriorityUrgent, 1, now + std::chrono::hours(1), nullptr, record(1));
+        cancellation->cancel();
+        
+        gate.set_value();
+    }
+    
+    // urgent by deadline, then normal with the cancelled read dropped, then prefetch
+    std::vector<int> expectedOrder = {1, 2, 3, 0, 4};
+    STAssertTrue(order == expectedOrder, @"");
+}
+
+
+- (void)testPrefetch
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    // only a hint without inflate
+    ResourcesManager::sharedManager()->prefetch({"test.txt", "missing.txt"});
+    STAssertEquals(ResourcesManager::sharedManager()->getContentCacheStats().insertions, (size_t)0, @"");
+    
+    ResourcesManager::sharedManager()->prefetch({"test.txt"}, true);
+    for (int i = 0; i < 100 && ResourcesManager::sharedManager()->getContentCacheStats().insertions == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    STAssertEquals(ResourcesManager::sharedManager()->getContentCacheStats().insertions, (size_t)1, @"");
+    
+    size_t bytesRead = 0;
+    ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    STAssertEquals(ResourcesManager::sharedManager()->getContentCacheStats().hits, (size_t)1, @"");
+}
+
+- (void)testAccessPredictor
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    WriteStringToFile(@"first", [rootFolder stringByAppendingPathComponent:@"first.txt"]);
+    WriteStringToFile(@"second", [rootFolder stringByAppendingPathComponent:@"second.txt"]);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    std::string tableFile = [[rootFolder stringByAppendingPathComponent:@"table"] UTF8String];
+    ResourcesManager::sharedManager()->enableAccessPredictor(tableFile);
+    
+    size_t bytesRead = 0;
+    for (int i = 0; i < 4; i++) {
+        for (const char* filename : {"first.txt", "test.txt", "second.txt"}) {
+            ResourcesManager::sharedManager()->readData(filename, &bytesRead);
+        }
+    }
+    AccessPredictorStats stats = ResourcesManager::sharedManager()->getAccessPredictorStats();
+    STAssertEquals(stats.accessesCount, (size_t)12, @"");
+    STAssertTrue(stats.getCoverage() > 0.5, @"");
+    STAssertTrue(stats.getAccuracy() > 0.9, @"");
+    STAssertTrue(ResourcesManager::sharedManager()->saveAccessPredictor(), @"");
+    
+    // the saved table predicts test.txt after first.txt in the next run
+    ResourcesManager::sharedManager()->reset();
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->enableAccessPredictor(tableFile);
+    
+    ResourcesManager::sharedManager()->readData("first.txt", &bytesRead);
+    for (int i = 0; i < 100 && ResourcesManager::sharedManager()->getContentCacheStats().insertions == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    STAssertEquals(ResourcesManager::sharedManager()->getContentCacheStats().hits, (size_t)1, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getAccessPredictorStats().usedPredictionsCount, (size_t)1, @"");
+}
+
+- (void)testPreload
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    WriteStringToFile(@"loose", [rootFolder stringByAppendingPathComponent:@"loose.txt"]);
+    ResourcesManager::sharedManager()->addRootFolder([rootFolder UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    NSString *manifestFile = [rootFolder stringByAppendingPathComponent:@"manifest"];
+    WriteStringToFile(@"# startup\ntest.txt\nmissing.txt\n", manifestFile);
+    
+    std::vector<PreloadItem> items = ResourcesManager::sharedManager()->preload([manifestFile UTF8String]).get();
+    STAssertEquals(items.size(), (size_t)2, @"");
+    STAssertEquals(items[0].status, PreloadStatusLoaded, @"");
+    STAssertEquals(items[1].status, PreloadStatusMissing, @"");
+    
+    size_t bytesRead = 0;
+    ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    STAssertEquals(ResourcesManager::sharedManager()->getContentCacheStats().hits, (size_t)1, @"");
+    
+    WriteStringToFile(@"loose.txt\n", manifestFile);
+    items = ResourcesManager::sharedManager()->preload([manifestFile UTF8String], true).get();
+    STAssertEquals(items[0].status, PreloadStatusLoaded, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getPinnedSize(), (size_t)5, @"");
+    ResourcesManager::sharedManager()->unpin("loose.txt");
+    
+    STAssertThrows(ResourcesManager::sharedManager()->preload([[rootFolder stringByAppendingPathComponent:@"missing"] UTF8String]).get(), @"");
+}
+
+- (void)testPreloadDuringAsyncMounts
+{
+    NSString *rootFolder = MakeTemporaryFolder();
+    WriteStringToFile(@"loose", [rootFolder stringByAppendingPathComponent:@"loose.txt"]);
+    NSString *manifestFile = [MakeTemporaryFolder() stringByAppendingPathComponent:@"manifest"];
+    WriteStringToFile(@"loose.txt\ntest.txt\n", manifestFile);
+    
+    // names are resolved once the pending mounts are done
+    ResourcesManager::sharedManager()->addRootFolderAsync([rootFolder UTF8String]);
+    ResourcesManager::sharedManager()->addArchiveAsync([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    std::vector<PreloadItem> items = ResourcesManager::sharedManager()->preload([manifestFile UTF8String], true).get();
+    STAssertEquals(items.size(), (size_t)2, @"");
+    STAssertEquals(items[0].status, PreloadStatusLoaded, @"");
+    STAssertEquals(items[1].status, PreloadStatusLoaded, @"");
+    
+    ResourcesManager::sharedManager()->unpin("loose.txt");
+    ResourcesManager::sharedManager()->unpin("test.txt");
+}
+
+- (void)testInflateThreads
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"res" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    ResourcesManager::sharedManager()->setInflateThreads(2, {0, 1});
+    STAssertEquals(ResourcesManager::sharedManager()->getInflateThreadsCount(), (size_t)2, @"");
+    
+    std::future<ResourceBlob> future = ResourcesManager::sharedManager()->readAsync("test.txt");
+    ResourcesManager::sharedManager()->setInflateThreads(1);
+    STAssertEquals(ResourcesManager::sharedManager()->getInflateThreadsCount(), (size_t)1, @"");
+    
+    ResourceBlob blob = future.get();
+    STAssertEqualObjects(BufferToString(blob.data(), blob.size()), @"test", @"");
+    
+    std::vector<ResourceBlob> blobs;
+    STAssertEquals(ResourcesManager::sharedManager()->readMany({"test.txt", "file_in_folder.txt"}, blobs), (size_t)2, @"");
+    STAssertEqualObjects(BufferToString(blobs[1].data(), blobs[1].size()), @"file_in_folder", @"");
+    
+    ResourcesManager::sharedManager()->reset();
+    STAssertEquals(ResourcesManager::sharedManager()->getInflateThreadsCount(), ThreadPool::getDefaultThreadsCount(), @"");
+}
+
+- (void)testThreadPoolReleasedByTask
+{
+    std::promise<void> released;
+    std::promise<void> done;
+    std::shared_future<void> releasedFuture = released.get_future().share();
+    std::future<void> doneFuture = done.get_future();
+    
+    // the last owner of the pool is one of its own tasks
+    {
+        std::shared_ptr<ThreadPool> threadPool = ThreadPool::makeShared(2);
+        threadPool->enqueue([threadPool, releasedFuture, &done]() mutable {
+            releasedFuture.wait();
+            threadPool.reset();
+            done.set_value();
+        });
+    }
+    released.set_value();
+    
+    STAssertEquals(doneFuture.wait_for(std::chrono::seconds(1)), std::future_status::ready, @"");
+}
+
+#ifdef RESOURCES_MANAGER_COROUTINES
+- (void)testCoroutineRead
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    
+    NSString *contents = nil;
+    size_t streamBytesRead = 0;
+    std::atomic<bool> done(false);
+    ReadTestFile(&contents, &streamBytesRead, &done);
+    
+    // resumes on the read threads without an executor
+    while (!done) {
+        std::this_thread::yield();
+    }
+    STAssertEqualObjects(contents, BufferToString(buffer.get(), bytesRead), @"");
+    STAssertEquals(streamBytesRead, (size_t)4, @"");
+}
+#endif
+
 @end